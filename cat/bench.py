@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+# GB/s of ./cat (make it first) against coreutils cat and plain 4 kB
+# read()/write() (dd bs=4096), for each kind of input and output:
+#     python3 bench.py [cat binary [MB]]
+import os, socket, subprocess, sys, tempfile, threading, time
+
+
+def drain(sock):
+    buf = bytearray(1 << 20)
+    while sock.recv_into(buf) != 0:
+        pass
+
+
+def run(command, src, dst, stdout=None):
+    start = time.perf_counter()
+    subprocess.run(command.format(src=src, dst=dst), shell=True, stdout=stdout, check=True)
+    return time.perf_counter() - start
+
+
+def main():
+    binary = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(os.path.abspath(__file__)), 'cat')
+    size = (int(sys.argv[2]) if len(sys.argv) > 2 else 1024) << 20
+    tools = (('cat', binary), ('coreutils cat', 'cat'), ('4 kB read/write', 'dd bs=4096 status=none'))
+    cases = (
+        ('file -> file', '{tool} < {src} > {dst}'),
+        ('file -> pipe', '{tool} < {src} | dd of=/dev/null bs=1M status=none'),
+        ('pipe -> pipe', 'dd if={src} bs=1M status=none | {tool} | dd of=/dev/null bs=1M status=none'),
+        ('file -> socket', '{tool} < {src}'),
+    )
+    with tempfile.TemporaryDirectory(dir=os.path.dirname(os.path.abspath(__file__))) as tmp:
+        src, dst = os.path.join(tmp, 'src'), os.path.join(tmp, 'dst')
+        with open(src, 'wb') as f:
+            for _ in range(size >> 20):
+                f.write(os.urandom(1 << 20))
+        print('%d MB, page cache warm%s' % (size >> 20, ''.join(' %16s' % name for name, _ in tools)))
+        for case, template in cases:
+            rates = []
+            for _, tool in tools:
+                command = template.replace('{tool}', tool)
+                best = None
+                for _ in range(3):
+                    if os.path.exists(dst):
+                        os.unlink(dst)
+                    if case == 'file -> socket':
+                        ours, theirs = socket.socketpair()
+                        reader = threading.Thread(target=drain, args=(theirs,))
+                        reader.start()
+                        elapsed = run(command, src, dst, stdout=ours)
+                        ours.close()
+                        reader.join()
+                        theirs.close()
+                    else:
+                        elapsed = run(command, src, dst)
+                    best = elapsed if best is None else min(best, elapsed)
+                rates.append(size / best / 1e9)
+            print('%-27s%s' % (case, ''.join(' %11.2f GB/s' % rate for rate in rates)))
+
+
+if __name__ == '__main__':
+    main()
@@ -1,16 +1,168 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 
-int main(int argc, char** argv) {
-    char buf[4096];
-    size_t cnt;
-    while((cnt = read(0, buf, 4096)) > 0) {
-        size_t written = 0;
-        while (cnt > 0) {
-            written = write(1, &buf[written], cnt);
-            cnt -= written;
+#define BUFFER_SIZE (1 << 20)
+// Bytes asked for per call by the in-kernel copies
+#define CHUNK_SIZE (1 << 30)
+
+// Results of the copy methods
+#define COPY_DONE 0
+#define COPY_ERROR -1
+#define COPY_UNSUPPORTED -2
+#define COPY_SAME_FILE -3
+
+
+// The methods below copy from the current offset of in up to its end. When
+// the kernel refuses the pair of fds, they return COPY_UNSUPPORTED and the
+// next method continues from where the offsets are.
+
+static int is_unsupported(int err) {
+    return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EBADF;
+}
+
+
+static int copy_range(int in, int out) {
+    ssize_t cnt;
+    while ((cnt = copy_file_range(in, NULL, out, NULL, CHUNK_SIZE, 0)) != 0) {
+        if (cnt == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return is_unsupported(errno) ? COPY_UNSUPPORTED : COPY_ERROR;
+        }
+    }
+    return COPY_DONE;
+}
+
+
+static int copy_sendfile(int in, int out) {
+    ssize_t cnt;
+    while ((cnt = sendfile(out, in, NULL, CHUNK_SIZE)) != 0) {
+        if (cnt == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return is_unsupported(errno) ? COPY_UNSUPPORTED : COPY_ERROR;
+        }
+    }
+    return COPY_DONE;
+}
+
+
+static int copy_splice(int in, int out) {
+    ssize_t cnt;
+    while ((cnt = splice(in, NULL, out, NULL, CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE)) != 0) {
+        if (cnt == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return is_unsupported(errno) ? COPY_UNSUPPORTED : COPY_ERROR;
+        }
+    }
+    return COPY_DONE;
+}
+
+
+static int copy_buffer(int in, int out) {
+    static char* buf = NULL;
+    if (buf == NULL && posix_memalign((void**) &buf, 4096, BUFFER_SIZE) != 0) {
+        return COPY_ERROR;
+    }
+
+    ssize_t cnt;
+    while ((cnt = read(in, buf, BUFFER_SIZE)) != 0) {
+        if (cnt == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return COPY_ERROR;
+        }
+        ssize_t written = 0;
+        while (written < cnt) {
+            ssize_t res = write(out, &buf[written], cnt - written);
+            if (res == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return COPY_ERROR;
+            }
+            written += res;
         }
     }
-    return 0;
+    return COPY_DONE;
+}
+
+
+// Copying a file onto itself may read back what has just been written and
+// never end. Like coreutils, cat refuses unless there is nothing to read and
+// the output goes past the end of the file.
+static int is_same_file(int in, int out, const struct stat* in_st, const struct stat* out_st) {
+    if (!S_ISREG(in_st->st_mode) || !S_ISREG(out_st->st_mode) ||
+            in_st->st_dev != out_st->st_dev || in_st->st_ino != out_st->st_ino) {
+        return 0;
+    }
+    return (fcntl(out, F_GETFL) & O_APPEND) != 0 || lseek(out, 0, SEEK_CUR) < in_st->st_size ||
+           lseek(in, 0, SEEK_CUR) < in_st->st_size;
+}
+
+
+// Picks the fastest way the kernel has for the pair of fds: copy_file_range
+// between files, sendfile from a file (to a socket or anything else), splice
+// when either end is a pipe, and a plain buffer copy as the last resort.
+static int copy_fd(int in, int out) {
+    struct stat in_st, out_st;
+    if (fstat(in, &in_st) == -1 || fstat(out, &out_st) == -1) {
+        return COPY_ERROR;
+    }
+    if (is_same_file(in, out, &in_st, &out_st)) {
+        return COPY_SAME_FILE;
+    }
+
+    // Files of /proc and /sys have no size and must be read() to be generated
+    int is_file = S_ISREG(in_st.st_mode) && in_st.st_size != 0;
+    int res = COPY_UNSUPPORTED;
+    if (is_file && S_ISREG(out_st.st_mode)) {
+        res = copy_range(in, out);
+    }
+    if (res == COPY_UNSUPPORTED && (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode))) {
+        res = copy_splice(in, out);
+    }
+    if (res == COPY_UNSUPPORTED && is_file) {
+        res = copy_sendfile(in, out);
+    }
+    if (res == COPY_UNSUPPORTED) {
+        res = copy_buffer(in, out);
+    }
+    return res;
+}
+
+
+int main(int argc, char** argv) {
+    int ret = 0;
+    int i = 1;
+    do {
+        const char* name = i < argc ? argv[i] : "-";
+        int in = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY);
+        int res = in == -1 ? COPY_ERROR : copy_fd(in, STDOUT_FILENO);
+        if (res == COPY_SAME_FILE) {
+            fprintf(stderr, "cat: %s: input file is output file\n", name);
+            ret = 1;
+        } else if (res == COPY_ERROR) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            ret = 1;
+        }
+        if (in != -1 && in != STDIN_FILENO) {
+            close(in);
+        }
+    } while (++i < argc);
+    return ret;
 }
@@ -0,0 +1,92 @@
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+
+extern char** environ;
+
+
+// Process launch on top of posix_spawn(). glibc runs it as
+// clone(CLONE_VM | CLONE_VFORK), so unlike fork() its cost does not grow
+// with the address space of the parent. The child starts with all signals
+// at their defaults and an empty mask. Fds that must not leak into the
+// child have to be close-on-exec.
+struct spawn_actions {
+    spawn_actions() : flags(POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK) {
+        posix_spawn_file_actions_init(&actions);
+        posix_spawnattr_init(&attr);
+        sigset_t all, none;
+        sigfillset(&all);
+        sigemptyset(&none);
+        posix_spawnattr_setsigdefault(&attr, &all);
+        posix_spawnattr_setsigmask(&attr, &none);
+    }
+
+    spawn_actions(spawn_actions const&) = delete;
+
+    ~spawn_actions() {
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+    }
+
+    // fd becomes target_fd in the child, nothing to do when they match.
+    spawn_actions& redirect(int fd, int target_fd) {
+        if (fd != target_fd) {
+            posix_spawn_file_actions_adddup2(&actions, fd, target_fd);
+        }
+        return *this;
+    }
+
+    // The child starts a new session (and process group) of its own.
+    spawn_actions& new_session() {
+        flags |= POSIX_SPAWN_SETSID;
+        return *this;
+    }
+
+    // A new session whose controlling terminal is the tty opened in it, which
+    // also becomes the standard input and outputs of the child.
+    spawn_actions& session_tty(const char* tty_path) {
+        new_session();
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, tty_path, O_RDWR, 0);
+        posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+        return *this;
+    }
+
+    // Looks file up in PATH. Returns the pid, or -1 with errno set, failures
+    // of exec itself included.
+    pid_t spawn(const char* file, char* const argv[]) {
+        return launch(posix_spawnp, file, argv);
+    }
+
+    // The same without the PATH lookup, path is used as is.
+    pid_t spawn_path(const char* path, char* const argv[]) {
+        return launch(posix_spawn, path, argv);
+    }
+
+private:
+    typedef int (*spawn_func)(pid_t*, const char*, const posix_spawn_file_actions_t*, const posix_spawnattr_t*,
+                              char* const[], char* const[]);
+
+    pid_t launch(spawn_func func, const char* file, char* const argv[]) {
+        posix_spawnattr_setflags(&attr, flags);
+        pid_t pid;
+        int res = func(&pid, file, &actions, &attr, argv, environ);
+        if (res != 0) {
+            errno = res;
+            return -1;
+        }
+        return pid;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    short flags;
+};
+
+#endif
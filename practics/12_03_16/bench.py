@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+# Seconds to filter a generated log with ./cat_grep (make it first), the
+# cat | grep pipeline it replaced and GNU grep -F, for a frequent and a rare
+# pattern. All of them write to a file, whose contents must match:
+#     python3 bench.py [cat_grep binary [MB]]
+import filecmp, os, random, subprocess, sys, tempfile, time
+
+
+def make_log(path, size):
+    users = ['alice', 'bob', 'carol', 'dave', 'eve']
+    paths = ['/api/v1/users', '/api/v1/orders', '/static/app.js', '/login', '/health']
+    rnd = random.Random(1)
+    with open(path, 'w') as f:
+        written, n = 0, 0
+        while written < size:
+            block = ''.join('2026-10-17T12:%02d:%02d.%03dZ %s req=%08x user=%s %s %d\n'
+                            % (n // 60000 % 60, n // 1000 % 60, n % 1000,
+                               'ERROR' if rnd.random() < 0.0001 else 'INFO', rnd.getrandbits(32),
+                               rnd.choice(users), rnd.choice(paths), rnd.randrange(1000))
+                            for n in range(n, n + 10000))
+            n += 10000
+            f.write(block)
+            written += len(block)
+
+
+def main():
+    binary = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(os.path.abspath(__file__)), 'cat_grep')
+    size = (int(sys.argv[2]) if len(sys.argv) > 2 else 512) << 20
+    tools = (
+        ('cat_grep -j1', binary + ' -j1 -e {pattern} {log}'),
+        ('cat_grep -j4', binary + ' -j4 -e {pattern} {log}'),
+        ('cat | grep', 'cat {log} | grep -- {pattern}'),
+        ('grep -F', 'grep -F -- {pattern} {log}'),
+        ('LC_ALL=C grep -F', 'LC_ALL=C grep -F -- {pattern} {log}'),
+    )
+    with tempfile.TemporaryDirectory(dir=os.path.dirname(os.path.abspath(__file__))) as tmp:
+        log = os.path.join(tmp, 'log')
+        make_log(log, size)
+        subprocess.run(['cat', log], stdout=subprocess.DEVNULL)
+        print('%d MB log      %s' % (size >> 20, ''.join(' %17s' % name for name, _ in tools)))
+        for pattern in ('user=bob', 'ERROR'):
+            times, outputs = [], []
+            for i, (_, template) in enumerate(tools):
+                out = os.path.join(tmp, 'out%d' % i)
+                command = template.format(pattern=pattern, log=log) + ' > ' + out
+                best = None
+                for _ in range(3):
+                    start = time.perf_counter()
+                    subprocess.run(command, shell=True)
+                    elapsed = time.perf_counter() - start
+                    best = elapsed if best is None else min(best, elapsed)
+                times.append(best)
+                outputs.append(out)
+            same = all(filecmp.cmp(outputs[0], out, shallow=False) for out in outputs[1:])
+            print('%-8s %6d kB out%s%s' % (pattern, os.path.getsize(outputs[0]) >> 10,
+                                          ''.join(' %15.3f s' % t for t in times), '' if same else '  OUTPUTS DIFFER'))
+
+
+if __name__ == '__main__':
+    main()
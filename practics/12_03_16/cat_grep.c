@@ -1,47 +1,577 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <ftw.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <sys/wait.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 
-int main(int argc, char const *argv[]) {
-    int fildes[2];
-    if (pipe(fildes) == -1) {
-        printf("Error while creating pipe!\n");
-        exit(-1);
+#define BUFFER_SIZE (1 << 20)
+// Files are split into chunks of about this size on line boundaries
+#define CHUNK_SIZE (4 << 20)
+// Chunks queued or waiting to be written, per worker
+#define INFLIGHT_PER_WORKER 16
+// iovecs written with one writev()
+#define BATCH 1024
+
+const char USAGE[] = "Usage: cat_grep [-e pattern] [-j threads] [file | dir]...\n";
+
+const char* pattern = "int";
+size_t pattern_len;
+// Lines are prefixed with the name of their file, as grep does for many files
+int show_names = 0;
+int has_match = 0;
+int has_error = 0;
+
+
+// Finds the pattern in [pos, end), NULL if it is not there.
+typedef const char* (*find_func)(const char* pos, const char* end);
+
+static const char* find_memmem(const char* pos, const char* end) {
+    return memmem(pos, end - pos, pattern, pattern_len);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Blocks of bytes are compared with the first and the last char of the
+// pattern at once, only the positions where both match are memcmp()ed.
+// The tail shorter than a block goes to memmem().
+static const char* find_sse2(const char* pos, const char* end) {
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[pattern_len - 1]);
+    for (; pos + pattern_len - 1 + 16 <= end; pos += 16) {
+        __m128i block_first = _mm_loadu_si128((const __m128i*) pos);
+        __m128i block_last = _mm_loadu_si128((const __m128i*) (pos + pattern_len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                        _mm_cmpeq_epi8(last, block_last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(pos + bit + 1, pattern + 1, pattern_len - 2) == 0) {
+                return pos + bit;
+            }
+            mask &= mask - 1;
+        }
     }
+    return find_memmem(pos, end);
+}
+
+__attribute__((target("avx2")))
+static const char* find_avx2(const char* pos, const char* end) {
+    const __m256i first = _mm256_set1_epi8(pattern[0]);
+    const __m256i last = _mm256_set1_epi8(pattern[pattern_len - 1]);
+    for (; pos + pattern_len - 1 + 32 <= end; pos += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*) pos);
+        __m256i block_last = _mm256_loadu_si256((const __m256i*) (pos + pattern_len - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                                                              _mm256_cmpeq_epi8(last, block_last)));
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(pos + bit + 1, pattern + 1, pattern_len - 2) == 0) {
+                return pos + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return find_memmem(pos, end);
+}
+#endif
+
+static const char* find_memchr(const char* pos, const char* end) {
+    return memchr(pos, pattern[0], end - pos);
+}
+
+
+find_func find = find_memmem;
 
-    int pid_cat = fork();
-    int pid_grep = -1;
-    int cat_ret, grep_ret;
 
-    if (pid_cat == -1) {
-        printf("Error while forking!\n");
+struct output {
+    struct iovec* iov;
+    size_t cnt, cap;
+};
+
+struct input {
+    char* name;
+    size_t name_len;
+    const char* data;       // mapped file, NULL for streams
+    size_t size;
+    size_t refs;            // chunks not written yet, plus one while splitting
+};
+
+struct chunk {
+    struct input* in;
+    const char* begin;
+    const char* end;
+    struct output out;
+    size_t matches;
+    int error;              // errno of a failed filter
+    int is_done;
+    struct chunk* next;     // in the order of output
+};
+
+// Each worker takes chunks from the front of its own deque, oldest first as
+// the main thread writes them, and once it is empty steals from the back of
+// the others'. The pool lock only counts the
+// queued chunks, so that idle workers can sleep, and signals finished ones.
+struct deque {
+    pthread_mutex_t lock;
+    struct chunk** items;   // ring of max_inflight
+    size_t head, cnt;
+};
+
+struct pool {
+    pthread_t* threads;
+    struct deque* deques;
+    size_t size;
+    size_t next;            // deque for the next chunk
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    size_t queued;
+    int is_stopped;
+};
+
+struct pool pool;
+size_t max_inflight;
+// Chunks in flight, written in this order by the main thread
+struct chunk* first_chunk = NULL;
+struct chunk* last_chunk = NULL;
+size_t inflight = 0;
+
+
+static int output_add(struct output* out, const void* buf, size_t len) {
+    if (out->cnt == out->cap) {
+        size_t cap = out->cap != 0 ? out->cap * 2 : 64;
+        struct iovec* iov = realloc(out->iov, cap * sizeof(*iov));
+        if (iov == NULL) {
+            return -1;
+        }
+        out->iov = iov;
+        out->cap = cap;
     }
+    out->iov[out->cnt].iov_base = (void*) buf;
+    out->iov[out->cnt].iov_len = len;
+    ++out->cnt;
+    return 0;
+}
 
-    if (pid_cat == 0) {
-        close(fildes[0]);
-        dup2(fildes[1], STDOUT_FILENO);
-        close(fildes[1]);
-        execlp("cat", "cat", argv[1], NULL);
-    } else {
-        pid_grep = fork();
-        if (pid_grep == -1) {
-            printf("Error while forking!\n");
+
+// Writes out everything queued, BATCH iovecs per writev().
+static int output_write(struct output* out) {
+    struct iovec* iov = out->iov;
+    size_t cnt = out->cnt;
+    out->cnt = 0;
+    while (cnt > 0) {
+        ssize_t written = writev(STDOUT_FILENO, iov, cnt < BATCH ? cnt : BATCH);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (cnt > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --cnt;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+
+static int emit_line(struct output* out, const struct input* in, const char* line, size_t len) {
+    if (show_names && (output_add(out, in->name, in->name_len) == -1 || output_add(out, ":", 1) == -1)) {
+        return -1;
+    }
+    return output_add(out, line, len);
+}
+
+
+// Queues the lines of [pos, end) that contain the pattern. The output points
+// into the data, so it has to be written before the data goes away. pos must
+// be at the beginning of a line.
+static int filter(const struct input* in, const char* pos, const char* end, struct output* out,
+                  size_t* matches) {
+    const char* match;
+    while (pos < end && (match = find(pos, end)) != NULL) {
+        const char* line = memrchr(pos, '\n', match - pos);
+        line = line != NULL ? line + 1 : pos;
+        const char* eol = memchr(match, '\n', end - match);
+        int res;
+        if (eol != NULL) {
+            res = emit_line(out, in, line, eol + 1 - line);
+            pos = eol + 1;
+        } else {
+            // The last line has no newline, grep adds one
+            res = emit_line(out, in, line, end - line);
+            res = res == -1 ? -1 : output_add(out, "\n", 1);
+            pos = end;
+        }
+        if (res == -1) {
+            return -1;
         }
+        ++*matches;
+    }
+    return 0;
+}
+
 
-        if (pid_grep == 0) {
-            close(fildes[1]);
-            dup2(fildes[0], STDIN_FILENO);
-            close(fildes[0]);
-            execlp("grep", "grep", "int", NULL);
+// For pipes and the like: large reads, the incomplete last line is carried
+// over to the next read.
+static int filter_stream(int fd, const struct input* in, size_t* matches) {
+    size_t cap = BUFFER_SIZE, size = 0;
+    char* buf = malloc(cap);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    struct output out = {NULL, 0, 0};
+    int res = 0;
+    while (res == 0) {
+        if (size == cap) {
+            // A line longer than the buffer
+            char* new_buf = realloc(buf, cap * 2);
+            if (new_buf == NULL) {
+                res = -1;
+                break;
+            }
+            buf = new_buf;
+            cap *= 2;
+        }
+        ssize_t cnt = read(fd, buf + size, cap - size);
+        if (cnt == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            res = -1;
+        } else if (cnt == 0) {
+            res = filter(in, buf, buf + size, &out, matches);
+            res = res == -1 ? -1 : output_write(&out);
+            break;
         } else {
-            waitpid(pid_cat, &cat_ret, WEXITED);
-            waitpid(pid_grep, &grep_ret, WEXITED);
+            const char* last = memrchr(buf + size, '\n', cnt);
+            size += cnt;
+            if (last == NULL) {
+                continue;
+            }
+            size_t complete = last + 1 - buf;
+            res = filter(in, buf, buf + complete, &out, matches);
+            res = res == -1 ? -1 : output_write(&out);
+            memmove(buf, buf + complete, size - complete);
+            size -= complete;
+        }
+    }
+    free(out.iov);
+    free(buf);
+    return res;
+}
+
+
+static void report(const char* name, int err) {
+    fprintf(stderr, "cat_grep: %s: %s\n", name, strerror(err));
+    has_error = 1;
+}
+
+
+static struct chunk* take_chunk(size_t self) {
+    pthread_mutex_lock(&pool.lock);
+    while (pool.queued == 0 && !pool.is_stopped) {
+        pthread_cond_wait(&pool.work_cond, &pool.lock);
+    }
+    if (pool.queued == 0) {
+        pthread_mutex_unlock(&pool.lock);
+        return NULL;
+    }
+    // One of the deques surely has a chunk for us now
+    --pool.queued;
+    pthread_mutex_unlock(&pool.lock);
+
+    for (size_t i = 0; ; ++i) {
+        struct deque* dq = &pool.deques[(self + i) % pool.size];
+        struct chunk* c = NULL;
+        pthread_mutex_lock(&dq->lock);
+        if (dq->cnt > 0) {
+            --dq->cnt;
+            if (i == 0) {
+                c = dq->items[dq->head];
+                dq->head = (dq->head + 1) % max_inflight;
+            } else {
+                c = dq->items[(dq->head + dq->cnt) % max_inflight];
+            }
+        }
+        pthread_mutex_unlock(&dq->lock);
+        if (c != NULL) {
+            return c;
         }
     }
+}
+
 
+static void* worker(void* arg) {
+    size_t self = (size_t) arg;
+    struct chunk* c;
+    while ((c = take_chunk(self)) != NULL) {
+        int res = filter(c->in, c->begin, c->end, &c->out, &c->matches);
+        pthread_mutex_lock(&pool.lock);
+        c->error = res == -1 ? errno : 0;
+        c->is_done = 1;
+        pthread_cond_broadcast(&pool.done_cond);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
 
 
+static void start_pool(size_t size) {
+    pool.size = size;
+    pool.threads = calloc(size, sizeof(pthread_t));
+    pool.deques = calloc(size, sizeof(struct deque));
+    if (pool.threads == NULL || pool.deques == NULL) {
+        perror("Error while starting workers");
+        exit(2);
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_cond, NULL);
+    pthread_cond_init(&pool.done_cond, NULL);
+    for (size_t i = 0; i < size; ++i) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        pool.deques[i].items = calloc(max_inflight, sizeof(struct chunk*));
+        if (pool.deques[i].items == NULL) {
+            perror("Error while starting workers");
+            exit(2);
+        }
+    }
+    for (size_t i = 0; i < size; ++i) {
+        int err = pthread_create(&pool.threads[i], NULL, worker, (void*) i);
+        if (err != 0) {
+            errno = err;
+            perror("Error while starting workers");
+            exit(2);
+        }
+    }
+}
+
+
+static void stop_pool() {
+    pthread_mutex_lock(&pool.lock);
+    pool.is_stopped = 1;
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.lock);
+    for (size_t i = 0; i < pool.size; ++i) {
+        pthread_join(pool.threads[i], NULL);
+    }
+}
+
+
+static void release_input(struct input* in) {
+    if (--in->refs == 0) {
+        if (in->data != NULL) {
+            munmap((void*) in->data, in->size);
+        }
+        free(in->name);
+        free(in);
+    }
+}
+
+
+// Waits for the oldest chunk and writes its lines.
+static void write_chunk() {
+    struct chunk* c = first_chunk;
+    pthread_mutex_lock(&pool.lock);
+    while (!c->is_done) {
+        pthread_cond_wait(&pool.done_cond, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (c->error != 0) {
+        report(c->in->name, c->error);
+    }
+    if (output_write(&c->out) == -1) {
+        perror("cat_grep: write error");
+        exit(2);
+    }
+    has_match |= c->matches != 0;
+
+    first_chunk = c->next;
+    if (first_chunk == NULL) {
+        last_chunk = NULL;
+    }
+    --inflight;
+    release_input(c->in);
+    free(c->out.iov);
+    free(c);
+}
+
+
+static void submit_chunk(struct input* in, const char* begin, const char* end) {
+    while (inflight >= max_inflight) {
+        write_chunk();
+    }
+    struct chunk* c = calloc(1, sizeof(struct chunk));
+    if (c == NULL) {
+        perror("cat_grep");
+        exit(2);
+    }
+    c->in = in;
+    c->begin = begin;
+    c->end = end;
+    ++in->refs;
+    if (last_chunk != NULL) {
+        last_chunk->next = c;
+    } else {
+        first_chunk = c;
+    }
+    last_chunk = c;
+    ++inflight;
+
+    // Round robin, stealing evens it out
+    struct deque* dq = &pool.deques[pool.next++ % pool.size];
+    pthread_mutex_lock(&dq->lock);
+    dq->items[(dq->head + dq->cnt) % max_inflight] = c;
+    ++dq->cnt;
+    pthread_mutex_unlock(&dq->lock);
+
+    pthread_mutex_lock(&pool.lock);
+    ++pool.queued;
+    pthread_cond_signal(&pool.work_cond);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+
+// Splits a mapped file into chunks for the workers, anything else is filtered
+// right here once the chunks before it are written.
+static void scan(const char* name) {
+    int is_stdin = strcmp(name, "-") == 0;
+    int fd = is_stdin ? STDIN_FILENO : open(name, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        report(name, errno);
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    struct input* in = calloc(1, sizeof(struct input));
+    if (in == NULL || (in->name = strdup(is_stdin ? "(standard input)" : name)) == NULL) {
+        perror("cat_grep");
+        exit(2);
+    }
+    in->name_len = strlen(in->name);
+    in->refs = 1;
+
+    // Files of /proc and /sys have no size and must be read() to be generated
+    if (S_ISREG(st.st_mode) && st.st_size != 0) {
+        const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            report(name, errno);
+        } else {
+            madvise((void*) data, st.st_size, MADV_SEQUENTIAL);
+            in->data = data;
+            in->size = st.st_size;
+            const char* pos = data;
+            const char* end = data + st.st_size;
+            while (pos < end) {
+                const char* split = NULL;
+                if ((size_t) (end - pos) > CHUNK_SIZE) {
+                    split = memchr(pos + CHUNK_SIZE, '\n', end - pos - CHUNK_SIZE);
+                }
+                split = split != NULL ? split + 1 : end;
+                submit_chunk(in, pos, split);
+                pos = split;
+            }
+        }
+    } else {
+        while (first_chunk != NULL) {
+            write_chunk();
+        }
+        size_t matches = 0;
+        if (filter_stream(fd, in, &matches) == -1) {
+            report(name, errno);
+        }
+        has_match |= matches != 0;
+    }
+    release_input(in);
+    if (!is_stdin) {
+        close(fd);
+    }
+}
+
+
+static int scan_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    if (type == FTW_F && S_ISREG(st->st_mode)) {
+        scan(path);
+    } else if (type == FTW_DNR) {
+        report(path, EACCES);
+    }
     return 0;
 }
+
+
+static int is_dir(const char* name) {
+    struct stat st;
+    return stat(name, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+
+int main(int argc, char* const argv[]) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "e:j:")) != -1) {
+        if (opt == 'e' && optarg[0] != 0) {
+            pattern = optarg;
+        } else if (opt == 'j' && atol(optarg) > 0) {
+            threads = atol(optarg);
+        } else {
+            printf("%s", USAGE);
+            return 2;
+        }
+    }
+    threads = threads > 0 ? threads : 1;
+
+    pattern_len = strlen(pattern);
+    if (pattern_len == 1) {
+        find = find_memchr;
+    } else {
+#if defined(__x86_64__) || defined(__i386__)
+        find = __builtin_cpu_supports("avx2") ? find_avx2 : find_sse2;
+#endif
+    }
+
+    int inputs = argc - optind;
+    show_names = inputs > 1 || (inputs == 1 && is_dir(argv[optind]));
+    max_inflight = INFLIGHT_PER_WORKER * threads;
+    start_pool(threads);
+
+    int i = optind;
+    do {
+        const char* name = i < argc ? argv[i] : "-";
+        if (is_dir(name)) {
+            // Symlinks met inside are not followed, like grep -r does
+            if (nftw(name, scan_entry, 64, FTW_PHYS) == -1) {
+                report(name, errno);
+            }
+        } else {
+            scan(name);
+        }
+    } while (++i < argc);
+
+    while (first_chunk != NULL) {
+        write_chunk();
+    }
+    stop_pool();
+    return has_error ? 2 : has_match ? 0 : 1;
+}
@@ -0,0 +1,280 @@
+#!/usr/bin/env python3
+# Benchmarks against a fresh ./rshd each (make it first):
+#     python3 bench.py throughput|storm|burst|echo|compress [rshd binary]
+# throughput and echo take the backend call counts from the debug log:
+# make clean && make LOG_LEVEL=1
+import os, random, re, selectors, signal, socket, struct, subprocess, sys, tempfile, time, zlib
+
+PORT, MUX_PORT = 7420, 7421
+
+
+class Server:
+    def __init__(self, binary, options, log_level='warning'):
+        self.log = tempfile.TemporaryFile()
+        self.proc = subprocess.Popen([binary, '-t', '1', '-l', log_level] + options + [str(PORT)],
+                                     stdout=self.log)
+        time.sleep(0.5)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.proc.terminate()
+        self.proc.wait()
+
+    def output(self):
+        self.log.seek(0)
+        return self.log.read().decode(errors='replace')
+
+    # Backend calls made by the loop while each session lived, in the order
+    # the sessions ended.
+    def calls_per_session(self):
+        totals = [int(n) for n in re.findall(r'calls on this loop: (\d+)', self.output())]
+        return [b - a for a, b in zip([0] + totals, totals)]
+
+
+def rss_kb(pid):
+    with open('/proc/%d/status' % pid) as f:
+        for line in f:
+            if line.startswith('VmRSS:'):
+                return int(line.split()[1])
+
+
+# read- and write-like system calls of the whole process so far
+def io_calls(pid):
+    with open('/proc/%d/io' % pid) as f:
+        fields = dict(line.split(': ') for line in f.read().splitlines())
+    return int(fields['syscr']) + int(fields['syscw'])
+
+
+def raw_session(command):
+    sock = socket.create_connection(('127.0.0.1', PORT))
+    sock.sendall(command)
+    received = 0
+    while True:
+        data = sock.recv(1 << 20)
+        if not data:
+            break
+        received += len(data)
+    sock.close()
+    return received
+
+
+# One bulk session at a time: MB/s and the epoll_ctl()/epoll_wait() (or
+# io_uring_enter()) calls it took, level-triggered against edge-triggered.
+def throughput(binary):
+    size = 256 << 20
+    for name, options in (('level-triggered', []), ('edge-triggered', ['-e']),
+                          ('level-triggered, splice', ['-s']), ('edge-triggered, splice', ['-e', '-s'])):
+        with Server(binary, options, 'debug') as server:
+            rates = []
+            for _ in range(3):
+                start = time.perf_counter()
+                received = raw_session(b'head -c %d /dev/zero; exit\n' % size)
+                rates.append(received / (time.perf_counter() - start) / 1e6)
+            time.sleep(0.2)
+        calls = server.calls_per_session()
+        if not calls:
+            sys.exit('no call counts in the log, is rshd built with LOG_LEVEL=1?')
+        print('%-24s %6.0f MB/s, %7d backend calls per session, %.1f per MB'
+              % (name, sorted(rates)[1], sorted(calls)[len(calls) // 2], sorted(calls)[len(calls) // 2] / (size >> 20)))
+
+
+# Connect/disconnect cycles: mux connections (a connection and a session, no
+# shell) in bulk, raw sessions (one shell each) fewer. The client resets
+# its end, so that TIME_WAIT does not run out of ports. RSS must level off.
+def storm(binary):
+    linger = struct.pack('ii', 1, 0)
+    with Server(binary, ['-m', str(MUX_PORT)]) as server:
+        for port, cycles, name in ((MUX_PORT, 1000000, 'mux'), (PORT, 3000, 'raw')):
+            rss = [rss_kb(server.proc.pid)]
+            start = time.perf_counter()
+            for i in range(1, cycles + 1):
+                sock = socket.create_connection(('127.0.0.1', port))
+                if port == PORT:
+                    sock.sendall(b'exit\n')
+                    sock.recv(100)
+                sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, linger)
+                sock.close()
+                if i % (cycles // 4) == 0:
+                    rss.append(rss_kb(server.proc.pid))
+            elapsed = time.perf_counter() - start
+            print('%s: %d cycles, %.0f/s, rss %s kB' % (name, cycles, cycles / elapsed, ' -> '.join(map(str, rss))))
+
+
+# Accepts/sec by the accept budget per wakeup (-a): the connections wait in
+# the backlog of a stopped server, the clock runs from SIGCONT until the
+# server holds a descriptor for each. Then a burst larger than the listen
+# backlog (-b) at a running server: the dropped SYNs are retried from 1 s on.
+def burst(binary):
+    count, linger = 2000, struct.pack('ii', 1, 0)
+    for options, stopped in ((['-a', '1'], True), (['-a', '64'], True), (['-a', '64', '-e'], True),
+                             (['-a', '64', '-u'], True), (['-a', '64', '-b', '64'], False)):
+        with Server(binary, ['-m', str(MUX_PORT), '-b', '4096'] + options) as server:
+            fd_dir = '/proc/%d/fd' % server.proc.pid
+            base = len(os.listdir(fd_dir))
+            if stopped:
+                server.proc.send_signal(signal.SIGSTOP)
+            socks = []
+            start = time.perf_counter()
+            for _ in range(count):
+                sock = socket.socket()
+                sock.setblocking(False)
+                sock.connect_ex(('127.0.0.1', MUX_PORT))
+                socks.append(sock)
+            if stopped:
+                time.sleep(0.5)
+                start = time.perf_counter()
+                server.proc.send_signal(signal.SIGCONT)
+            while len(os.listdir(fd_dir)) < base + count and time.perf_counter() - start < 10:
+                time.sleep(0.001)
+            elapsed = time.perf_counter() - start
+            accepted = len(os.listdir(fd_dir)) - base
+            for sock in socks:
+                sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, linger)
+                sock.close()
+        print('%-14s %-8s %4d of %d accepted in %.3f s, %6.0f/s' % (' '.join(options), 'backlog' if stopped else 'burst',
+                                                                  accepted, count, elapsed, accepted / elapsed))
+
+
+# Many concurrent sessions, each running cat on its pty and echoing a short
+# line back over and over. Round trips/sec over all of them, backend calls
+# per round trip (session setup and teardown included) and the reads and
+# writes of the timed part, for the epoll and io_uring backends in both modes.
+def echo(binary):
+    sessions, seconds, line = 100, 5, b'ping\n'
+    for name, options in (('epoll', []), ('epoll, edge', ['-e']), ('io_uring', ['-u']),
+                          ('io_uring, edge', ['-e', '-u'])):
+        with Server(binary, options, 'debug') as server:
+            sel = selectors.DefaultSelector()
+            socks = []
+            for _ in range(sessions):
+                sock = socket.create_connection(('127.0.0.1', PORT))
+                sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+                sock.sendall(b'exec cat\n')
+                socks.append(sock)
+            time.sleep(1)
+            for sock in socks:
+                sock.setblocking(False)
+                while True:
+                    try:
+                        sock.recv(1 << 16)
+                    except BlockingIOError:
+                        break
+                sel.register(sock, selectors.EVENT_READ, bytearray())
+                sock.sendall(line)
+            trips, io_start = 0, io_calls(server.proc.pid)
+            start = time.perf_counter()
+            while time.perf_counter() - start < seconds:
+                for key, _ in sel.select(1):
+                    received = key.data
+                    received += key.fileobj.recv(1 << 16)
+                    while received.startswith(line):
+                        del received[:len(line)]
+                        trips += 1
+                        key.fileobj.sendall(line)
+            elapsed = time.perf_counter() - start
+            io = io_calls(server.proc.pid) - io_start
+            for sock in socks:
+                sock.close()
+            time.sleep(1)
+        backend_calls = sum(server.calls_per_session())
+        if backend_calls == 0:
+            sys.exit('no call counts in the log, is rshd built with LOG_LEVEL=1?')
+        print('%-16s %d sessions, %6.0f round trips/s, per round trip %.2f backend calls and %.2f reads/writes'
+              % (name, sessions, trips / elapsed, backend_calls / trips, io / trips))
+
+
+# A session that takes the MCCP offer of -z. Keeps the output decompressed.
+class CompressedSession:
+    WILL, DO, START = b'\xff\xfb\x56', b'\xff\xfd\x56', b'\xff\xfa\x56\xff\xf0'
+
+    def __init__(self, compress):
+        self.sock = socket.create_connection(('127.0.0.1', PORT))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.inflate = zlib.decompressobj() if compress else None
+        self.started = not compress
+        self.plain, self.wire = bytearray(), 0
+        if compress:
+            self.sock.sendall(self.DO)
+        self.until(b'# ')
+        while not self.started:
+            self.receive()
+
+    def receive(self):
+        data = self.sock.recv(1 << 20)
+        if not data:
+            sys.exit('connection closed')
+        self.wire += len(data)
+        if self.started:
+            self.plain += self.inflate.decompress(data) if self.inflate else data
+            return
+        self.plain += data
+        head, start, rest = bytes(self.plain).partition(self.START)
+        if start:
+            self.plain = bytearray(head.removeprefix(self.WILL)) + self.inflate.decompress(rest)
+            self.started = True
+
+    # Waits for the marker and drops the output up to its end.
+    def until(self, marker):
+        pos = 0
+        while (end := self.plain.find(marker, pos)) == -1:
+            pos = max(0, len(self.plain) - len(marker) + 1)
+            self.receive()
+        del self.plain[:end + len(marker)]
+
+    def command(self, line, marker):
+        self.sock.sendall(line)
+        self.until(marker)
+
+
+# Bulk throughput and wire size of a log against the round trip of a short
+# command, without compression and at several -z levels.
+def compress(binary):
+    with tempfile.NamedTemporaryFile('w') as log:
+        rnd = random.Random(1)
+        for n in range(600000):
+            log.write('2026-10-17T12:%02d:%02d.%03dZ INFO req=%08x user=%s %s %d\n'
+                      % (n // 60000 % 60, n // 1000 % 60, n % 1000, rnd.getrandbits(32),
+                         rnd.choice(['alice', 'bob', 'carol']), rnd.choice(['/api/v1/users', '/login']),
+                         rnd.randrange(1000)))
+        log.flush()
+        size = os.path.getsize(log.name)
+        for level in (0, 1, 3, 6, 9):
+            with Server(binary, ['-z', str(level)] if level else []):
+                session = CompressedSession(level != 0)
+                wire = session.wire
+                start = time.perf_counter()
+                session.command(b'cat %s; echo __END__\n' % log.name.encode(), b'__END__\n')
+                elapsed = time.perf_counter() - start
+                wire = session.wire - wire
+                times = []
+                for i in range(200):
+                    start = time.perf_counter()
+                    session.command(b'echo m%d\n' % i, b'm%d\n' % i)
+                    times.append(time.perf_counter() - start)
+                times.sort()
+                session.sock.close()
+            print('%-5s %5.1f MB in %.2f s, %4.0f MB/s, %5.1f%% on the wire, round trip median %.0f us, p90 %.0f us'
+                  % ('-z %d' % level if level else 'raw', size / 1e6, elapsed, size / elapsed / 1e6,
+                     100.0 * wire / size, times[100] * 1e6, times[180] * 1e6))
+
+
+BENCHMARKS = {
+    'throughput': throughput,
+    'storm': storm,
+    'burst': burst,
+    'echo': echo,
+    'compress': compress,
+}
+
+
+def main():
+    if len(sys.argv) < 2 or sys.argv[1] not in BENCHMARKS:
+        sys.exit('Usage: bench.py %s [rshd binary]' % '|'.join(BENCHMARKS))
+    binary = sys.argv[2] if len(sys.argv) > 2 else os.path.join(os.path.dirname(os.path.abspath(__file__)), 'rshd')
+    BENCHMARKS[sys.argv[1]](binary)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,157 @@
+// Events/sec of the fd-indexed dispatch table against the unordered_map of
+// std::function handlers it replaced, with 10k registered fds:
+//     make bench_dispatch && ./bench_dispatch [fds [events]]
+// Every fd is an eventfd that stays readable, so each level-triggered wait
+// returns a full batch. "dispatch only" replays one batch without syscalls.
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include "networking.h"
+
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+struct counter: io_handler {
+    counter(io_service& ios, size_t& count, size_t limit) : ios(ios), count(count), limit(limit) {}
+
+    void handle_events(int) override {
+        if (++count == limit) {
+            ios.stop();
+        }
+    }
+
+    io_service& ios;
+    size_t& count;
+    size_t limit;
+};
+
+
+// The removed design: the fd in epoll_event.data, a hash lookup per event
+// and a bound member function behind std::function.
+struct old_service {
+    typedef std::function<void(int)> iofunc_t;
+
+    old_service() : epoll_fd(epoll_create1(0)) {}
+
+    ~old_service() {
+        close(epoll_fd);
+    }
+
+    void add(int sock, int events, iofunc_t func) {
+        epoll_event ev;
+        ev.events = events;
+        ev.data.fd = sock;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+        handlers.emplace(sock, func);
+    }
+
+    void dispatch(epoll_event const* events, int num) {
+        for (int i = 0; i < num; ++i) {
+            auto it = handlers.find(events[i].data.fd);
+            if (it != handlers.end()) {
+                it->second(events[i].events);
+            }
+        }
+    }
+
+    void run(size_t limit, size_t& count) {
+        epoll_event events[1000];
+        while (count < limit) {
+            int num = epoll_wait(epoll_fd, events, 1000, 1000);
+            dispatch(events, num);
+        }
+    }
+
+    int epoll_fd;
+    std::unordered_map<int, iofunc_t> handlers;
+};
+
+struct old_handler {
+    void handle(int) {
+        ++*count;
+    }
+
+    size_t* count;
+};
+
+
+int main(int argc, char* argv[]) {
+    size_t fds = argc > 1 ? atol(argv[1]) : 10000;
+    size_t limit = argc > 2 ? atol(argv[2]) : 10000000;
+    rlimit lim = {fds + 64, fds + 64};
+    if (setrlimit(RLIMIT_NOFILE, &lim) == -1) {
+        perror("setrlimit()");
+        return errno;
+    }
+    std::vector<int> events_fds;
+    for (size_t i = 0; i < fds; ++i) {
+        int fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd == -1) {
+            perror("eventfd()");
+            return errno;
+        }
+        events_fds.push_back(fd);
+    }
+
+    size_t count = 0;
+    io_service ios;
+    std::vector<std::unique_ptr<counter>> counters;
+    for (int fd: events_fds) {
+        counters.emplace_back(new counter(ios, count, limit));
+        ios.add(fd, EPOLLIN, counters.back().get());
+    }
+    auto start = std::chrono::steady_clock::now();
+    ios.run();
+    double table_wait = count / seconds_since(start);
+
+    count = 0;
+    old_service old;
+    std::vector<old_handler> old_handlers(fds, old_handler{&count});
+    for (size_t i = 0; i < fds; ++i) {
+        old.add(events_fds[i], EPOLLIN, std::bind(&old_handler::handle, &old_handlers[i],
+                                                  std::placeholders::_1));
+    }
+    start = std::chrono::steady_clock::now();
+    old.run(limit, count);
+    double map_wait = count / seconds_since(start);
+
+    // The same batch of 1000 events over and over
+    std::vector<epoll_event> batch(1000);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        batch[i].events = EPOLLIN;
+        batch[i].data.ptr = counters[i * fds / batch.size()].get();
+    }
+    count = 0;
+    start = std::chrono::steady_clock::now();
+    while (count < limit) {
+        for (epoll_event const& ev: batch) {
+            static_cast<io_handler*>(ev.data.ptr)->handle_events(ev.events);
+        }
+    }
+    double table_only = count / seconds_since(start);
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+        batch[i].data.fd = events_fds[i * fds / batch.size()];
+    }
+    count = 0;
+    start = std::chrono::steady_clock::now();
+    while (count < limit) {
+        old.dispatch(batch.data(), batch.size());
+    }
+    double map_only = count / seconds_since(start);
+
+    printf("%zu fds, %zu events     with epoll_wait    dispatch only\n", fds, limit);
+    printf("fd-indexed table      %10.2f M/s    %10.2f M/s\n", table_wait / 1e6, table_only / 1e6);
+    printf("unordered_map         %10.2f M/s    %10.2f M/s\n", map_wait / 1e6, map_only / 1e6);
+
+    for (int fd: events_fds) {
+        close(fd);
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+// Spawns/sec of posix_spawn() (launch.h) against fork()+exec as the parent
+// grows, the parent's memory is touched so that it is all mapped:
+//     make bench_spawn && ./bench_spawn [spawns [MB...]]
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "launch.h"
+
+
+static char TRUE_PATH[] = "/bin/true";
+
+
+static pid_t fork_exec() {
+    pid_t pid = fork();
+    if (pid == 0) {
+        setsid();
+        char* const argv[] = {TRUE_PATH, nullptr};
+        execv(TRUE_PATH, argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+
+static pid_t posix_spawn_exec() {
+    char* const argv[] = {TRUE_PATH, nullptr};
+    return spawn_actions().new_session().spawn_path(TRUE_PATH, argv);
+}
+
+
+static double spawns_per_second(pid_t (*launch)(), int spawns) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < spawns; ++i) {
+        pid_t pid = launch();
+        if (pid == -1) {
+            perror("spawn");
+            exit(errno);
+        }
+        waitpid(pid, nullptr, 0);
+    }
+    return spawns / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+int main(int argc, char* argv[]) {
+    int spawns = argc > 1 ? atoi(argv[1]) : 1000;
+    std::vector<size_t> sizes;
+    for (int i = 2; i < argc; ++i) {
+        sizes.push_back(atol(argv[i]));
+    }
+    if (sizes.empty()) {
+        sizes = {0, 256, 1024, 2048};
+    }
+
+    printf("parent RSS    fork+exec     posix_spawn\n");
+    size_t mapped = 0;
+    for (size_t mb: sizes) {
+        if (mb > mapped) {
+            size_t len = (mb - mapped) << 20;
+            void* mem = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) {
+                perror("mmap()");
+                return errno;
+            }
+            memset(mem, 1, len);
+            mapped = mb;
+        }
+        double forked = spawns_per_second(fork_exec, spawns);
+        double spawned = spawns_per_second(posix_spawn_exec, spawns);
+        printf("%6zu MB    %7.0f/s     %7.0f/s\n", mb, forked, spawned);
+    }
+    return 0;
+}
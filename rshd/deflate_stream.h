@@ -0,0 +1,58 @@
+#ifndef DEFLATE_STREAM_H
+#define DEFLATE_STREAM_H
+
+#include <zlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string_view>
+#include "ring_buffer.h"
+
+
+// One zlib stream (RFC 1950) of outgoing data. The history carries over from
+// call to call, a flush only makes everything so far decompressible without
+// waiting for more: Z_SYNC_FLUSH ends the deflate block and costs a few bytes.
+struct deflate_stream {
+    explicit deflate_stream(int level) {
+        memset(&zs, 0, sizeof(zs));
+        int res = deflateInit(&zs, level);
+        if (res != Z_OK) {
+            fprintf(stderr, "deflateInit() error %d\n", res);
+            exit(res == Z_MEM_ERROR ? ENOMEM : EINVAL);
+        }
+    }
+
+    deflate_stream(deflate_stream const&) = delete;
+
+    ~deflate_stream() {
+        deflateEnd(&zs);
+    }
+
+    // Appends the compressed data to out, which may stay empty until the
+    // next flush.
+    void compress(std::string_view data, bool flush, ring_buffer& out) {
+        char buf[16 * 1024];
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        zs.avail_in = data.size();
+        do {
+            zs.next_out = reinterpret_cast<Bytef*>(buf);
+            zs.avail_out = sizeof(buf);
+            deflate(&zs, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+            out.append(buf, sizeof(buf) - zs.avail_out);
+        } while (zs.avail_out == 0);
+    }
+
+    size_t total_in() const {
+        return zs.total_in;
+    }
+
+    size_t total_out() const {
+        return zs.total_out;
+    }
+
+private:
+    z_stream zs;
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include "log.h"
+
+
+struct io_handler;
+
+
+// How io_service learns about readiness. Whatever the backend, events come
+// back as epoll_event with the handler in data.ptr and EPOLL* bits.
+struct io_backend {
+    virtual ~io_backend() = default;
+
+    virtual void add(int fd, int events, io_handler* handler) = 0;
+    virtual void change(int fd, int events, io_handler* handler) = 0;
+    virtual void remove(int fd) = 0;
+
+    // Returns the number of events, or -1 with errno set. timeout_ms of -1
+    // waits forever.
+    virtual int wait(epoll_event* events, int max_events, int timeout_ms) = 0;
+
+    virtual const char* name() const = 0;
+
+    // System calls made so far to change the interest and to wait.
+    size_t syscalls() const {
+        return calls;
+    }
+
+protected:
+    size_t calls = 0;
+};
+
+
+struct epoll_backend: io_backend {
+    epoll_backend() {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd == -1) {
+            perror("epoll_create1()");
+            exit(errno);
+        }
+    }
+
+    epoll_backend(epoll_backend const&) = delete;
+
+    ~epoll_backend() {
+        LOG_TRACE("close(), %d", epoll_fd);
+        close(epoll_fd);
+    }
+
+    void add(int fd, int events, io_handler* handler) override {
+        ctl(EPOLL_CTL_ADD, fd, events, handler);
+    }
+
+    void change(int fd, int events, io_handler* handler) override {
+        ctl(EPOLL_CTL_MOD, fd, events, handler);
+    }
+
+    void remove(int fd) override {
+        ctl(EPOLL_CTL_DEL, fd, 0, nullptr);     // the event is ignored since 2.6.9
+    }
+
+    int wait(epoll_event* events, int max_events, int timeout_ms) override {
+        ++calls;
+        return epoll_wait(epoll_fd, events, max_events, timeout_ms);
+    }
+
+    const char* name() const override {
+        return "epoll";
+    }
+
+private:
+    void ctl(int op, int fd, int events, io_handler* handler) {
+        epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = handler;
+        ++calls;
+        epoll_ctl(epoll_fd, op, fd, &ev);
+    }
+
+    int epoll_fd;
+};
+
+#endif
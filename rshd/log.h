@@ -0,0 +1,198 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+
+enum class log_level { trace, debug, info, warning, error, none };
+
+// Messages below LOG_LEVEL are not compiled in at all (make LOG_LEVEL=0 for
+// everything), the runtime level filters the rest.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 2
+#endif
+
+constexpr log_level COMPILED_LOG_LEVEL = static_cast<log_level>(LOG_LEVEL);
+
+
+// Formats messages on the calling thread into a bounded lock-free MPSC queue
+// of fixed-size records; a background thread writes them to stdout, so the
+// event loops never block on it. Messages are dropped when the queue is full.
+// The thread sleeps on a futex while the queue is empty, the message that
+// finds it asleep wakes it.
+struct logger {
+    static logger& instance() {
+        static logger inst;
+        return inst;
+    }
+
+    static bool is_on(log_level level) {
+        return level >= runtime_level.load(std::memory_order_relaxed);
+    }
+
+    static void set_level(log_level level) {
+        runtime_level = level;
+    }
+
+    // Accepts "trace", "debug", "info", "warning", "error" or "none".
+    static bool parse_level(const char* name, log_level& level) {
+        static const char* const names[] = {"trace", "debug", "info", "warning", "error", "none"};
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+            if (strcasecmp(name, names[i]) == 0) {
+                level = static_cast<log_level>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    __attribute__((format(printf, 3, 4)))
+    void write(log_level level, const char* fmt, ...) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        record* rec;
+        while (true) {
+            rec = &records[pos & (CAPACITY - 1)];
+            size_t seq = rec->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        static const char prefixes[] = "TDIWE";
+        int len = snprintf(rec->text, RECORD_SIZE, "[%c] ", prefixes[static_cast<int>(level)]);
+        va_list args;
+        va_start(args, fmt);
+        int cnt = vsnprintf(rec->text + len, RECORD_SIZE - len, fmt, args);
+        va_end(args);
+        len = std::min(len + std::max(cnt, 0), static_cast<int>(RECORD_SIZE) - 1);
+        rec->text[len] = '\n';
+        rec->len = len + 1;
+
+        rec->sequence.store(pos + 1, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (idle.load(std::memory_order_relaxed) && idle.exchange(false)) {
+            idle.notify_one();
+        }
+    }
+
+private:
+    static const size_t CAPACITY = 4096;        // power of two
+    static const size_t RECORD_SIZE = 256;
+    static const int BATCH = 64;
+
+    struct record {
+        std::atomic<size_t> sequence;
+        size_t len;
+        char text[RECORD_SIZE];
+    };
+
+    logger() : enqueue_pos(0), dequeue_pos(0), dropped(0), is_terminating(false),
+               idle(false) {
+        for (size_t i = 0; i < CAPACITY; ++i) {
+            records[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        drainer = std::thread(&logger::drain, this);
+    }
+
+    ~logger() {
+        is_terminating = true;
+        idle = false;
+        idle.notify_one();
+        drainer.join();
+    }
+
+    void drain() {
+        while (true) {
+            bool stopping = is_terminating.load();
+            if (flush_batch() != 0) {
+                continue;
+            }
+            if (stopping) {
+                break;
+            }
+            // A record published before idle is set is seen by is_ready(),
+            // one published after it finds idle set and clears it.
+            idle = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!is_ready() && !is_terminating.load()) {
+                idle.wait(true);
+            }
+            idle = false;
+        }
+    }
+
+    bool is_ready() const {
+        return records[dequeue_pos & (CAPACITY - 1)].sequence.load(std::memory_order_acquire) == dequeue_pos + 1;
+    }
+
+    // Writes up to BATCH ready records with one writev(), returns how many.
+    int flush_batch() {
+        iovec iov[BATCH];
+        int num = 0;
+        while (num < BATCH) {
+            record& rec = records[(dequeue_pos + num) & (CAPACITY - 1)];
+            if (rec.sequence.load(std::memory_order_acquire) != dequeue_pos + num + 1) {
+                break;
+            }
+            iov[num].iov_base = rec.text;
+            iov[num].iov_len = rec.len;
+            ++num;
+        }
+        if (num != 0) {
+            writev(STDOUT_FILENO, iov, num);
+            for (int i = 0; i < num; ++i, ++dequeue_pos) {
+                records[dequeue_pos & (CAPACITY - 1)].sequence.store(dequeue_pos + CAPACITY, std::memory_order_release);
+            }
+        }
+
+        size_t lost = dropped.exchange(0, std::memory_order_relaxed);
+        if (lost != 0) {
+            dprintf(STDOUT_FILENO, "[W] %zu log messages dropped\n", lost);
+        }
+        return num;
+    }
+
+    static inline std::atomic<log_level> runtime_level{log_level::info};
+
+    record records[CAPACITY];
+    std::atomic<size_t> enqueue_pos;
+    size_t dequeue_pos;
+    std::atomic<size_t> dropped;
+    std::atomic<bool> is_terminating;
+    std::atomic<bool> idle;
+    std::thread drainer;
+};
+
+
+#define LOG_AT(level, ...) do { \
+        if constexpr ((level) >= COMPILED_LOG_LEVEL) { \
+            if (logger::is_on(level)) { \
+                logger::instance().write((level), __VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+#define LOG_TRACE(...) LOG_AT(log_level::trace, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(log_level::debug, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(log_level::info, __VA_ARGS__)
+#define LOG_WARNING(...) LOG_AT(log_level::warning, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(log_level::error, __VA_ARGS__)
+
+#endif
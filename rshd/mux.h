@@ -0,0 +1,720 @@
+#ifndef MUX_H
+#define MUX_H
+
+#include <arpa/inet.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unordered_map>
+#include <memory>
+#include "networking.h"
+#include "shell_pool.h"
+
+
+// Many shells and commands over one connection. Every frame is a header of
+//     u32 channel, u8 type, u32 payload length
+// in network byte order, followed by at most MUX_MAX_FRAME bytes of payload.
+//
+//     OPEN     client: start a shell on a new channel. The payload is the u32
+//              window for its output, or empty for MUX_INITIAL_WINDOW.
+//     OPEN_OK  server: the shell runs, the payload is the u32 window for its
+//              input.
+//     DATA     input of the shell from the client, its output from the server.
+//     WINDOW   u32 more bytes of DATA the sender of the frame accepts. The
+//              server uses at most MUX_MAX_WINDOW of it at a time.
+//     CLOSE    the shell is gone (server) or should go (client). It is
+//              answered with a CLOSE unless one was sent already, the channel
+//              id is free again once both sides have sent one.
+//     EXEC     client: run a command on a new channel, without a pty. The
+//              payload is the u32 window for its output and the command line
+//              for /bin/sh -c. Answered like OPEN, a CLOSE without OPEN_OK
+//              means the command could not be started.
+//     STDERR   server: the stderr of a command, counted in the same window
+//              as DATA, which carries its stdout.
+//     EOF      client: the stdin of a command ends once the DATA sent so far
+//              is written.
+//     EXIT     server: the u32 exit status of a command, as $? of the shell,
+//              after all of its output and before CLOSE.
+//
+// DATA beyond the window, unknown channels and types close the connection.
+enum mux_frame_type: uint8_t {
+    MUX_OPEN = 1, MUX_OPEN_OK, MUX_DATA, MUX_WINDOW, MUX_CLOSE, MUX_EXEC, MUX_STDERR, MUX_EOF, MUX_EXIT
+};
+
+const size_t MUX_HEADER_SIZE = 9;
+const uint32_t MUX_MAX_FRAME = 16 * 1024;
+const uint32_t MUX_INITIAL_WINDOW = 256 * 1024;
+const uint32_t MUX_MAX_WINDOW = 4 * 1024 * 1024;
+
+
+inline uint32_t mux_get_u32(const char* buf) {
+    uint32_t val;
+    memcpy(&val, buf, sizeof(val));
+    return ntohl(val);
+}
+
+inline void mux_put_u32(char* buf, uint32_t val) {
+    val = htonl(val);
+    memcpy(buf, &val, sizeof(val));
+}
+
+inline void mux_put_header(char* buf, uint32_t channel, uint8_t type, uint32_t length) {
+    mux_put_u32(buf, channel);
+    buf[4] = type;
+    mux_put_u32(buf + 5, length);
+}
+
+inline void mux_send_u32(connection& con, uint32_t channel, uint8_t type, uint32_t val) {
+    char frame[MUX_HEADER_SIZE + 4];
+    mux_put_header(frame, channel, type, 4);
+    mux_put_u32(frame + MUX_HEADER_SIZE, val);
+    con.write({frame, sizeof(frame)});
+}
+
+
+// What the two kinds of channels share: the windows in both directions and
+// the frames.
+struct mux_channel {
+    virtual ~mux_channel() = default;
+
+    bool is_open() const {
+        return !closed;
+    }
+
+    // Input from the client, false if it is over the window.
+    virtual bool receive(std::string_view data) = 0;
+
+    virtual void add_window(uint32_t inc) = 0;
+
+    // The connection has sent enough of its queue to take more output.
+    virtual void resume_output() {}
+
+    // EOF from the client, false if the channel does not take one.
+    virtual bool end_input() {
+        return false;
+    }
+
+protected:
+    mux_channel(io_service& ios, connection& con, uint32_t id, uint32_t send_window)
+            : ios(ios), con(con), id(id), send_window(std::min(send_window, MUX_MAX_WINDOW)) {}
+
+    mux_channel(mux_channel const&) = delete;
+
+    bool take_recv_window(size_t size) {
+        if (size > recv_window) {
+            return false;
+        }
+        recv_window -= size;
+        return true;
+    }
+
+    // Sending less than the client allows is always fine, so whatever it
+    // grants beyond MUX_MAX_WINDOW is dropped.
+    void grow_send_window(uint32_t inc) {
+        send_window = std::min<uint64_t>(static_cast<uint64_t>(send_window) + inc, MUX_MAX_WINDOW);
+    }
+
+    // Output stops while the connection is above its high watermark, the
+    // session resumes the channels on its low one.
+    bool can_send() const {
+        return send_window != 0 && !con.is_write_paused();
+    }
+
+    // cnt bytes of input are consumed. The client gets its window back in
+    // pieces, or all of it once the input is idle.
+    void grant(size_t cnt, bool idle) {
+        credit += cnt;
+        if (credit >= MUX_INITIAL_WINDOW / 4 || (idle && credit != 0)) {
+            recv_window += credit;
+            mux_send_u32(con, id, MUX_WINDOW, credit);
+            credit = 0;
+        }
+    }
+
+    // Sends what fd has as frames of the type while can_send(): one
+    // read() per call when level-triggered and not draining, until EAGAIN
+    // otherwise. Returns true once fd has nothing more to read.
+    bool pump(int fd, uint8_t type, bool drain, bool& readable) {
+        char frame[MUX_HEADER_SIZE + MUX_MAX_FRAME];
+        while (can_send()) {
+            ssize_t cnt = ::read(fd, frame + MUX_HEADER_SIZE, std::min(send_window, MUX_MAX_FRAME));
+            LOG_TRACE("channel %u read() from %d -> %zd", id, fd, cnt);
+            if (cnt == -1 && errno == EINTR) {
+                continue;
+            } else if (cnt <= 0) {
+                readable = false;
+                return true;
+            }
+            send_window -= cnt;
+            mux_put_header(frame, id, type, cnt);
+            con.write({frame, MUX_HEADER_SIZE + cnt});
+            if (!drain && !ios.is_edge_triggered()) {
+                break;
+            }
+        }
+        return false;
+    }
+
+    void send_close() {
+        closed = true;
+        char frame[MUX_HEADER_SIZE];
+        mux_put_header(frame, id, MUX_CLOSE, 0);
+        con.write({frame, sizeof(frame)});
+    }
+
+    io_service& ios;
+    connection& con;
+    uint32_t id;
+    bool closed = false;
+    uint32_t send_window;                       // output the client still accepts
+    uint32_t recv_window = MUX_INITIAL_WINDOW;  // input the client may still send
+    uint32_t credit = 0;                        // input consumed, not yet granted back
+};
+
+
+// One shell of a mux session. Works like rshd_data, with frames around the
+// data and the windows of the channel pausing the pty instead of the
+// connection watermarks.
+struct pty_channel: mux_channel, io_handler {
+    pty_channel(io_service& ios, connection& con, uint32_t id, shell_process const& shell, uint32_t send_window)
+            : mux_channel(ios, con, id, send_window), ptymfd(shell.ptymfd), shell(shell) {
+        pty_events = EPOLLRDHUP | (send_window != 0 ? EPOLLIN : 0);
+        ios.add(ptymfd, pty_events, this);
+    }
+
+    ~pty_channel() {
+        shut();
+    }
+
+    // Ends the shell and tells the client, once.
+    void shut() {
+        if (!is_open()) {
+            return;
+        }
+        LOG_DEBUG("Closing channel %u, shell %d", id, shell.pid);
+        if (!hung_up) {
+            ios.remove(ptymfd);
+        } else {
+            ios.forget(this);
+        }
+        end_shell(ios, shell);
+        close(ptymfd);
+        ptymfd = -1;
+        send_close();
+    }
+
+    bool receive(std::string_view data) override {
+        if (!take_recv_window(data.size())) {
+            return false;
+        }
+        if (is_open() && !hung_up) {
+            input.append(data);
+            set_pty_events(pty_events | EPOLLOUT);
+        }
+        return true;
+    }
+
+    void add_window(uint32_t inc) override {
+        grow_send_window(inc);
+        resume_output();
+    }
+
+    // May be called from inside a write to the connection, so a drain of
+    // the hung up pty goes through the loop.
+    void resume_output() override {
+        if (!is_open() || !can_send()) {
+            return;
+        } else if (hung_up) {
+            ios.post(this, EPOLLHUP);
+        } else {
+            set_pty_events(pty_events | EPOLLIN);
+        }
+    }
+
+    void handle_events(int event) override {
+        if (ios.is_edge_triggered()) {
+            pty_readable |= (event & EPOLLIN) != 0;
+            pty_writable |= (event & EPOLLOUT) != 0;
+            event &= pty_events | EPOLLHUP | EPOLLERR;
+        }
+        if (event & EPOLLOUT) {
+            pump_input();
+        }
+        if (event & (EPOLLHUP | EPOLLERR)) {
+            hang_up();
+        } else if (event & EPOLLIN) {
+            pump_output(false);
+        }
+    }
+
+private:
+    // The shell is gone, but what it wrote last may still be waiting for the
+    // window. The pty would report the hangup forever, so it leaves the loop
+    // and is drained from resume_output() until it is empty.
+    void hang_up() {
+        if (!hung_up) {
+            hung_up = true;
+            ios.remove(ptymfd);
+        }
+        if (pump_output(true)) {
+            shut();
+        }
+    }
+
+    // Same as rshd_data: one write per event when level-triggered, until
+    // EAGAIN when edge-triggered.
+    void pump_input() {
+        size_t written = 0;
+        while (!input.empty()) {
+            ssize_t cnt = input.write_to(ptymfd);
+            if (cnt == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                pty_writable = false;
+                break;
+            }
+            written += cnt;
+            if (!ios.is_edge_triggered()) {
+                break;
+            }
+        }
+        if (input.empty()) {
+            set_pty_events(pty_events & ~EPOLLOUT);
+        }
+        grant(written, input.empty());
+    }
+
+    // Returns true once the pty has nothing more to read.
+    bool pump_output(bool drain) {
+        bool is_empty = pump(ptymfd, MUX_DATA, drain, pty_readable);
+        if (!can_send() && !hung_up) {
+            set_pty_events(pty_events & ~EPOLLIN);
+        }
+        return is_empty;
+    }
+
+    void set_pty_events(int new_events) {
+        if (new_events == pty_events) {
+            return;
+        }
+        int enabled = new_events & ~pty_events;
+        pty_events = new_events;
+        ios.change(ptymfd, pty_events);
+        // No new edge will come for readiness we have already seen.
+        int ready = enabled & ((pty_readable ? EPOLLIN : 0) | (pty_writable ? EPOLLOUT : 0));
+        if (ios.is_edge_triggered() && ready != 0) {
+            ios.post(this, ready);
+        }
+    }
+
+    int ptymfd;
+    shell_process shell;
+    int pty_events;
+    bool pty_readable = false, pty_writable = false;     // edge-triggered mode only
+    bool hung_up = false;
+    ring_buffer input;
+};
+
+
+// One command run by /bin/sh -c without a pty: its stdin, stdout and stderr
+// are pipes, so the output is not cooked by a line discipline and comes
+// unchanged in DATA and STDERR frames. Both share the window of the channel.
+// The exit is watched through a pidfd. EXIT goes out once the command has
+// exited and both outputs have reached EOF, followed by CLOSE.
+struct exec_channel: mux_channel {
+    exec_channel(io_service& ios, connection& con, uint32_t id, uint32_t send_window, std::string_view command)
+            : mux_channel(ios, con, id, send_window),
+              stdin_pipe(*this, 0), stdout_pipe(*this, MUX_DATA), stderr_pipe(*this, MUX_STDERR), exit_watch(*this, 0) {
+        if (!start(command)) {
+            send_close();
+        }
+    }
+
+    ~exec_channel() {
+        shut();
+    }
+
+    // Ends the command if it still runs and tells the client, once.
+    void shut() {
+        if (!is_open()) {
+            return;
+        }
+        LOG_DEBUG("Closing channel %u, command %d", id, pid);
+        close_pipe(stdin_pipe);
+        close_pipe(stdout_pipe);
+        close_pipe(stderr_pipe);
+        if (exit_watch.fd != -1) {
+            // The command leads its own process group, whatever it started
+            // goes with it.
+            kill(-pid, SIGKILL);
+            ios.remove(exit_watch.fd);
+            new child_reaper(ios, exit_watch.fd);
+            exit_watch.fd = -1;
+        }
+        send_close();
+    }
+
+    bool receive(std::string_view data) override {
+        if (!take_recv_window(data.size())) {
+            return false;
+        }
+        if (stdin_pipe.fd != -1 && !input_eof) {
+            input.append(data);
+            set_events(stdin_pipe, EPOLLOUT);
+        } else if (is_open()) {
+            // Nobody reads it, but the client must not stall on the window
+            grant(data.size(), true);
+        }
+        return true;
+    }
+
+    void add_window(uint32_t inc) override {
+        grow_send_window(inc);
+        resume_output();
+    }
+
+    // Hung up pipes are drained through the loop, as for pty_channel.
+    void resume_output() override {
+        if (!can_send()) {
+            return;
+        }
+        for (watch* w: {&stdout_pipe, &stderr_pipe}) {
+            if (w->fd == -1) {
+                continue;
+            } else if (w->hung_up) {
+                ios.post(w, EPOLLHUP);
+            } else {
+                set_events(*w, EPOLLIN);
+            }
+        }
+    }
+
+    bool end_input() override {
+        input_eof = true;
+        if (input.empty()) {
+            close_pipe(stdin_pipe);
+        }
+        return true;
+    }
+
+private:
+    // An fd of the command in the loop.
+    struct watch: io_handler {
+        watch(exec_channel& ch, uint8_t type) : ch(ch), type(type) {}
+
+        void handle_events(int event) override {
+            ch.handle_events(*this, event);
+        }
+
+        exec_channel& ch;
+        uint8_t type;           // of the frames for an output
+        int fd = -1;
+        int events = 0;
+        bool ready = false;     // edge-triggered mode only
+        bool hung_up = false;
+    };
+
+    bool start(std::string_view command) {
+        int in[2], out[2], err[2];
+        if (pipe2(in, O_CLOEXEC) == -1) {
+            return failed("pipe2()");
+        }
+        if (pipe2(out, O_CLOEXEC) == -1) {
+            close(in[0]);
+            close(in[1]);
+            return failed("pipe2()");
+        }
+        if (pipe2(err, O_CLOEXEC) == -1) {
+            for (int fd: {in[0], in[1], out[0], out[1]}) {
+                close(fd);
+            }
+            return failed("pipe2()");
+        }
+
+        std::string cmd(command);
+        char sh[] = "/bin/sh", dash_c[] = "-c";
+        char* const argv[] = {sh, dash_c, cmd.data(), nullptr};
+        pid = spawn_actions().new_session().redirect(in[0], STDIN_FILENO).redirect(out[1], STDOUT_FILENO)
+                             .redirect(err[1], STDERR_FILENO).spawn_path(sh, argv);
+        int spawn_errno = errno;
+        for (int fd: {in[0], out[1], err[1]}) {
+            close(fd);
+        }
+        stdin_pipe.fd = in[1];
+        stdout_pipe.fd = out[0];
+        stderr_pipe.fd = err[0];
+        if (pid == -1) {
+            errno = spawn_errno;
+            return failed("posix_spawn()");
+        }
+
+        exit_watch.fd = syscall(SYS_pidfd_open, pid, 0);
+        if (exit_watch.fd == -1) {
+            failed("pidfd_open()");
+            kill(-pid, SIGKILL);
+            waitpid(pid, nullptr, 0);
+            return false;
+        }
+        fcntl(exit_watch.fd, F_SETFD, FD_CLOEXEC);
+        LOG_DEBUG("channel %u, command %d: %s", id, pid, cmd.c_str());
+
+        int out_events = send_window != 0 ? EPOLLIN : 0;
+        for (watch* w: {&stdin_pipe, &stdout_pipe, &stderr_pipe}) {
+            fcntl(w->fd, F_SETFL, O_NONBLOCK);
+            w->events = w == &stdin_pipe ? 0 : out_events;
+            ios.add(w->fd, w->events, w);
+        }
+        exit_watch.events = EPOLLIN;
+        ios.add(exit_watch.fd, exit_watch.events, &exit_watch);
+        return true;
+    }
+
+    // Closes whatever start() has opened so far.
+    bool failed(const char* what) {
+        LOG_WARNING("channel %u, %s error %d", id, what, errno);
+        for (watch* w: {&stdin_pipe, &stdout_pipe, &stderr_pipe}) {
+            if (w->fd != -1) {
+                close(w->fd);
+                w->fd = -1;
+            }
+        }
+        return false;
+    }
+
+    void handle_events(watch& w, int event) {
+        if (ios.is_edge_triggered()) {
+            w.ready |= (event & (EPOLLIN | EPOLLOUT)) != 0;
+            event &= w.events | EPOLLHUP | EPOLLERR;
+        }
+        if (&w == &exit_watch) {
+            reap();
+        } else if (&w == &stdin_pipe) {
+            if (event & (EPOLLHUP | EPOLLERR)) {
+                // The command does not read its input anymore
+                close_pipe(stdin_pipe);
+                grant(input.size(), true);
+                input.consume(input.size());
+            } else if (event & EPOLLOUT) {
+                pump_input();
+            }
+        } else if (event & (EPOLLHUP | EPOLLERR)) {
+            hang_up(w);
+        } else if (event & EPOLLIN) {
+            pump_output(w);
+        }
+    }
+
+    void pump_input() {
+        size_t written = 0;
+        while (!input.empty()) {
+            ssize_t cnt = input.write_to(stdin_pipe.fd);
+            if (cnt == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                stdin_pipe.ready = false;
+                break;
+            }
+            written += cnt;
+            if (!ios.is_edge_triggered()) {
+                break;
+            }
+        }
+        if (input.empty()) {
+            set_events(stdin_pipe, 0);
+        }
+        grant(written, input.empty());
+        if (input.empty() && input_eof) {
+            close_pipe(stdin_pipe);
+        }
+    }
+
+    void pump_output(watch& w) {
+        pump(w.fd, w.type, false, w.ready);
+        if (!can_send()) {
+            for (watch* o: {&stdout_pipe, &stderr_pipe}) {
+                if (o->fd != -1 && !o->hung_up) {
+                    set_events(*o, 0);
+                }
+            }
+        }
+    }
+
+    // All writers of the pipe are gone. Like the pty, it is drained from
+    // resume_output() while it waits for the window or the connection.
+    void hang_up(watch& w) {
+        if (!w.hung_up) {
+            w.hung_up = true;
+            ios.remove(w.fd);
+        }
+        if (pump(w.fd, w.type, true, w.ready)) {
+            close_pipe(w);
+            finish();
+        }
+    }
+
+    void reap() {
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(static_cast<idtype_t>(P_PIDFD), exit_watch.fd, &info, WEXITED | WNOHANG) == -1) {
+            LOG_WARNING("channel %u, waitid() error %d", id, errno);
+            status = 255;
+        } else if (info.si_pid == 0) {
+            return;
+        } else {
+            // As the shell reports it in $?
+            status = info.si_code == CLD_EXITED ? info.si_status : 128 + info.si_status;
+        }
+        LOG_DEBUG("channel %u, command %d exited with %u", id, pid, status);
+        ios.remove(exit_watch.fd);
+        close(exit_watch.fd);
+        exit_watch.fd = -1;
+        exited = true;
+        finish();
+    }
+
+    void finish() {
+        if (exited && stdout_pipe.fd == -1 && stderr_pipe.fd == -1 && is_open()) {
+            mux_send_u32(con, id, MUX_EXIT, status);
+            shut();
+        }
+    }
+
+    void close_pipe(watch& w) {
+        if (w.fd == -1) {
+            return;
+        }
+        if (!w.hung_up) {
+            ios.remove(w.fd);
+        } else {
+            ios.forget(&w);
+        }
+        close(w.fd);
+        w.fd = -1;
+    }
+
+    void set_events(watch& w, int new_events) {
+        if (new_events == w.events || w.fd == -1) {
+            return;
+        }
+        int enabled = new_events & ~w.events;
+        w.events = new_events;
+        ios.change(w.fd, w.events);
+        // No new edge will come for readiness we have already seen.
+        if (ios.is_edge_triggered() && w.ready && enabled != 0) {
+            ios.post(&w, enabled);
+        }
+    }
+
+    watch stdin_pipe, stdout_pipe, stderr_pipe, exit_watch;
+    pid_t pid = -1;
+    bool exited = false;
+    uint32_t status = 0;
+    bool input_eof = false;
+    ring_buffer input;
+};
+
+
+// The channels of one mux connection. The session lives in the frame of the
+// coroutine reading the connection, see serve().
+struct mux_session {
+    static const size_t MAX_CHANNELS = 1024;
+
+    mux_session(io_service& ios, connection& con, shell_pool& shells, size_t loop)
+            : ios(ios), con(con), shells(shells), loop(loop) {}
+
+    mux_session(mux_session const&) = delete;
+
+    // Reads frames until the client goes away or breaks the protocol. The
+    // channels and their shells go with the session.
+    static task serve(connection_ref con, io_service& ios, shell_pool& shells, size_t loop) {
+        mux_session session(ios, *con, shells, loop);
+        con->add_on_write_low_handler([&session](connection&) {
+            session.resume_output();
+        });
+        char header[MUX_HEADER_SIZE];
+        std::unique_ptr<char[]> payload(new char[MUX_MAX_FRAME]);
+        while (co_await con->read_exact(header) == sizeof(header)) {
+            uint32_t channel = mux_get_u32(header);
+            uint8_t type = header[4];
+            uint32_t length = mux_get_u32(header + 5);
+            if (length > MUX_MAX_FRAME) {
+                LOG_WARNING("%d - mux frame of %u bytes", con->get_fd(), length);
+                break;
+            }
+            if (co_await con->read_exact({payload.get(), length}) != length) {
+                break;
+            }
+            if (!session.handle_frame(channel, type, {payload.get(), length})) {
+                LOG_WARNING("%d - mux protocol error, channel %u, type %d", con->get_fd(), channel, type);
+                break;
+            }
+        }
+        con->close();
+    }
+
+    // Returns false on a protocol error.
+    bool handle_frame(uint32_t channel, uint8_t type, std::string_view payload) {
+        auto it = channels.find(channel);
+        if (type == MUX_OPEN) {
+            if (it != channels.end() || channels.size() >= MAX_CHANNELS ||
+                    (payload.size() != 0 && payload.size() != 4)) {
+                return false;
+            }
+            uint32_t window = payload.empty() ? MUX_INITIAL_WINDOW : mux_get_u32(payload.data());
+            shell_process shell = shells.claim(loop);
+            LOG_DEBUG("%d - channel %u, shell %d", con.get_fd(), channel, shell.pid);
+            channels.emplace(channel, std::make_unique<pty_channel>(ios, con, channel, shell, window));
+            mux_send_u32(con, channel, MUX_OPEN_OK, MUX_INITIAL_WINDOW);
+            return true;
+        } else if (type == MUX_EXEC) {
+            if (it != channels.end() || channels.size() >= MAX_CHANNELS || payload.size() <= 4) {
+                return false;
+            }
+            uint32_t window = mux_get_u32(payload.data());
+            auto exec = std::make_unique<exec_channel>(ios, con, channel, window, payload.substr(4));
+            if (exec->is_open()) {
+                mux_send_u32(con, channel, MUX_OPEN_OK, MUX_INITIAL_WINDOW);
+            }
+            channels.emplace(channel, std::move(exec));
+            return true;
+        }
+
+        if (it == channels.end()) {
+            return false;
+        }
+        if (type == MUX_DATA) {
+            return it->second->receive(payload);
+        } else if (type == MUX_WINDOW) {
+            if (payload.size() != 4) {
+                return false;
+            }
+            it->second->add_window(mux_get_u32(payload.data()));
+            return true;
+        } else if (type == MUX_EOF) {
+            return payload.empty() && it->second->end_input();
+        } else if (type == MUX_CLOSE) {
+            // Answers with a CLOSE if the shell or the command is still there
+            channels.erase(it);
+            return true;
+        }
+        return false;
+    }
+
+    void resume_output() {
+        for (auto& [id, channel]: channels) {
+            channel->resume_output();
+        }
+    }
+
+private:
+    io_service& ios;
+    connection& con;
+    shell_pool& shells;
+    size_t loop;
+    std::unordered_map<uint32_t, std::unique_ptr<mux_channel>> channels;
+};
+
+#endif
@@ -2,85 +2,217 @@
 #define NETWORKING_H
 
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
-#include <unordered_map>
 #include <vector>
+#include <coroutine>
 #include <functional>
 #include <string>
+#include <span>
+#include <memory>
+#include <thread>
+#include <atomic>
 #include <errno.h>
 #include <fcntl.h>
+#include "ring_buffer.h"
+#include "splice_pipe.h"
+#include "timer_wheel.h"
+#include "object_pool.h"
+#include "io_backend.h"
+#include "uring_backend.h"
+#include "log.h"
 
 
 struct tcp_server;
+struct connection_ref;
 
 
-struct io_service {
-    typedef std::function<void(int)> iofunc_t;
+// Anything that can be registered in io_service. The handler pointer itself
+// comes back in epoll_event.data.ptr, so dispatching an event is one virtual
+// call.
+struct io_handler {
+    virtual ~io_handler() = default;
+    virtual void handle_events(int events) = 0;
+};
+
 
-    io_service() {
-        epoll_fd = epoll_create(1);
-        // TODO: check for an error
+// In edge-triggered mode every fd is registered once for both directions
+// with EPOLLET and change() never touches the backend: handlers keep their
+// own interest mask, remember readiness and drain fds until EAGAIN.
+struct io_service {
+    explicit io_service(bool edge_triggered = false, bool use_uring = false)
+            : edge_triggered(edge_triggered), timers(timer_wheel::now_ms()) {
+        if (use_uring) {
+            backend = uring_backend::create(edge_triggered);
+            if (!backend) {
+                LOG_WARNING("io_uring is not available, falling back to epoll");
+            }
+        }
+        if (!backend) {
+            backend.reset(new epoll_backend());
+        }
         is_terminating = false;
+        next_event = num_events = 0;
+        loop_time = timer_wheel::now_ms();
     };
 
     io_service(io_service const& other) = delete;
 
-    ~io_service() {
-        printf("close(), %d\n", epoll_fd);
-        close(epoll_fd);
-    }
-
     io_service& operator=(io_service&& other) {
-        std::swap(epoll_fd, other.epoll_fd);
-        std::swap(is_terminating, other.is_terminating);
+        std::swap(backend, other.backend);
+        std::swap(edge_triggered, other.edge_triggered);
+        is_terminating = other.is_terminating.exchange(is_terminating);
         std::swap(handlers, other.handlers);
         return *this;
     }
 
-    void add(int sock, int events, iofunc_t func) {
-        printf("adding to epoll, fd=%d, events=%d\n", sock, events);
-        epoll_event ev;
-        ev.events = events;
-        ev.data.fd = sock;
-        handlers.emplace(sock, func);
-        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+    void add(int sock, int events, io_handler* handler) {
+        LOG_TRACE("adding to %s, fd=%d, events=%d", backend->name(), sock, events);
+        if (static_cast<size_t>(sock) >= handlers.size()) {
+            handlers.resize(sock + 1, nullptr);
+        }
+        handlers[sock] = handler;
+
+        if (edge_triggered) {
+            events |= EPOLLIN | EPOLLOUT | EPOLLET;
+        }
+        backend->add(sock, events, handler);
     }
 
     void change(int sock, int events) {
-        printf("changing epoll, fd=%d, events=%d\n", sock, events);
+        if (edge_triggered) {
+            return;
+        }
+        LOG_TRACE("changing %s, fd=%d, events=%d", backend->name(), sock, events);
+        backend->change(sock, events, handlers[sock]);
+    }
+
+    // Delivers events to the handler after the current batch. Edge-triggered
+    // handlers use it when they re-enable a direction whose edge has already
+    // been consumed.
+    void post(io_handler* handler, int events) {
         epoll_event ev;
         ev.events = events;
-        ev.data.fd = sock;
-        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock, &ev);
+        ev.data.ptr = handler;
+        posted.push_back(ev);
+    }
+
+    bool is_edge_triggered() const {
+        return edge_triggered;
+    }
+
+    // Timer callbacks run on the loop thread and may reschedule timers.
+    void schedule(timer& t, uint64_t delay_ms) {
+        timers.schedule(t, loop_time + delay_ms);
+    }
+
+    void cancel(timer& t) {
+        timers.cancel(t);
+    }
+
+    // Milliseconds on the monotonic clock as of the last wakeup of the loop.
+    uint64_t now() const {
+        return loop_time;
+    }
+
+    // Resumes the coroutine after the current batch of events and timers.
+    void post(std::coroutine_handle<> coro) {
+        resumable.push_back(coro);
+    }
+
+    struct sleep_awaitable {
+        io_service& ios;
+        uint64_t delay_ms;
+        timer wakeup;
+
+        bool await_ready() const {
+            return delay_ms == 0;
+        }
+
+        // The timer lives in the coroutine frame, so the coroutine is not
+        // resumed from the timer callback but right after it.
+        void await_suspend(std::coroutine_handle<> coro) {
+            wakeup.callback = [this, coro]() {
+                ios.post(coro);
+            };
+            ios.schedule(wakeup, delay_ms);
+        }
+
+        void await_resume() const {}
+    };
+
+    // co_await ios.sleep(ms) suspends the coroutine for ms milliseconds.
+    sleep_awaitable sleep(uint64_t delay_ms) {
+        return {*this, delay_ms, {}};
+    }
+
+    const char* backend_name() const {
+        return backend->name();
+    }
+
+    // System calls made by the backend to change the interest and to wait.
+    size_t backend_calls() const {
+        return backend->syscalls();
     }
 
     void remove(int sock) {
-        epoll_event ev;     // for kernel before 2.6.9 support
-        handlers.erase(sock);
-        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, &ev);
+        io_handler* handler = handlers[sock];
+        handlers[sock] = nullptr;
+        backend->remove(sock);
+        forget(handler);
+    }
+
+    // The handler may be destroyed right after this, so drop the events for
+    // it that are still waiting in the current batch or were posted.
+    void forget(io_handler* handler) {
+        for (int i = next_event; i < num_events; ++i) {
+            if (events[i].data.ptr == handler) {
+                events[i].data.ptr = nullptr;
+            }
+        }
+        for (auto& ev: posted) {
+            if (ev.data.ptr == handler) {
+                ev.data.ptr = nullptr;
+            }
+        }
     }
 
     void run() {
-        #define MAX_EVENTS 1000
-        epoll_event events[MAX_EVENTS];
         while(!is_terminating) {
-            int num_ev = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);
-            if (num_ev == -1) {
-                perror("epoll_wait1");
-                exit(errno);
+            // Wake up at least once a second to notice stop().
+            int64_t timeout = timers.next_timeout(loop_time);
+            if (timeout == -1 || timeout > 1000) {
+                timeout = 1000;
+            }
+            num_events = backend->wait(events, MAX_EVENTS, timeout);
+            if (num_events == -1) {
+                if (errno != EINTR) {
+                    perror("wait for events");
+                    exit(errno);
+                }
+                num_events = 0;
             }
-            for (int i = 0; i < num_ev; ++i) {
-                auto it = handlers.find(events[i].data.fd);
-                printf("events for fd=%d, events=%d\n", events[i].data.fd, events[i].events);
-                if (it != handlers.end()) {
-                    it->second(events[i].events);
+            loop_time = timer_wheel::now_ms();
+            dispatch();
+            timers.advance(loop_time);
+
+            while (!posted.empty() || !resumable.empty()) {
+                std::swap(resuming, resumable);
+                for (auto coro: resuming) {
+                    coro.resume();
                 }
+                resuming.clear();
+                num_events = std::min(posted.size(), static_cast<size_t>(MAX_EVENTS));
+                std::copy(posted.begin(), posted.begin() + num_events, events);
+                posted.erase(posted.begin(), posted.begin() + num_events);
+                dispatch();
             }
         }
     }
@@ -90,15 +222,120 @@ struct io_service {
     }
 
 private:
-    int epoll_fd;
-    bool is_terminating;
-    std::unordered_map<int, iofunc_t> handlers;
+    static const int MAX_EVENTS = 1000;
+
+    void dispatch() {
+        for (next_event = 0; next_event < num_events;) {
+            epoll_event& ev = events[next_event++];
+            LOG_TRACE("events for handler=%p, events=%d", ev.data.ptr, ev.events);
+            if (ev.data.ptr != nullptr) {
+                static_cast<io_handler*>(ev.data.ptr)->handle_events(ev.events);
+            }
+        }
+        next_event = num_events = 0;
+    }
+
+    std::unique_ptr<io_backend> backend;
+    bool edge_triggered;
+    std::atomic<bool> is_terminating;
+    std::vector<io_handler*> handlers;     // indexed by fd
+    std::vector<epoll_event> posted;
+    std::vector<std::coroutine_handle<>> resumable, resuming;
+    timer_wheel timers;
+    uint64_t loop_time;
+    epoll_event events[MAX_EVENTS];
+    int next_event, num_events;
 };
 
 
-struct connection {
+// Runs one io_service per thread. Nothing is shared between the loops:
+// every fd (and every handler) stays on the loop it was added to.
+struct io_service_pool {
+    explicit io_service_pool(size_t size = 0, bool edge_triggered = false, bool use_uring = false) {
+        if (size == 0) {
+            size = std::thread::hardware_concurrency();
+        }
+        if (size == 0) {
+            size = 1;
+        }
+        for (size_t i = 0; i < size; ++i) {
+            services.emplace_back(new io_service(edge_triggered, use_uring));
+        }
+    }
+
+    io_service_pool(io_service_pool const&) = delete;
+
+    size_t size() const {
+        return services.size();
+    }
+
+    io_service& operator[](size_t i) {
+        return *services[i];
+    }
+
+    // The calling thread runs the first loop, the rest get their own threads.
+    void run() {
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < services.size(); ++i) {
+            threads.emplace_back(&io_service::run, services[i].get());
+        }
+        services[0]->run();
+        for (auto& thread: threads) {
+            thread.join();
+        }
+    }
+
+    void stop() {
+        for (auto& ios: services) {
+            ios->stop();
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<io_service>> services;
+};
+
+
+// Keeps the first N handlers inline, connections rarely have more than one
+// per event and should not allocate for them (an empty vector does not
+// either). Handlers never move once added, the rest are boxed, so they are
+// called in place by index even if one of them adds another.
+template<typename F, size_t N = 2>
+struct handler_list {
+    void push_back(F func) {
+        if (count < N) {
+            inline_items[count] = std::move(func);
+        } else {
+            rest.push_back(std::make_unique<F>(std::move(func)));
+        }
+        ++count;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    F const& operator[](size_t i) const {
+        return i < N ? inline_items[i] : *rest[i - N];
+    }
+
+private:
+    F inline_items[N];
+    std::vector<std::unique_ptr<F>> rest;
+    size_t count = 0;
+};
+
+
+struct connection: io_handler {
     typedef std::function<void(connection&)> confunc_t;
+    typedef handler_list<confunc_t> handlers_t;
     friend tcp_server;
+    friend connection_ref;
+    friend object_pool<connection>;
 
     friend bool operator==(connection const& first, connection const& second) {
         return first.sock == second.sock;
@@ -118,6 +355,8 @@ struct connection {
         std::swap(on_read_ready, other.on_read_ready);
         std::swap(on_write_ready, other.on_write_ready);
         std::swap(on_close, other.on_close);
+        std::swap(in_buf, other.in_buf);
+        std::swap(out_buf, other.out_buf);
         return *this;
     }
 
@@ -137,57 +376,367 @@ struct connection {
         on_read_eof.push_back(func);
     }
 
+    // Coroutines can drive the connection instead of handlers, one waiting
+    // for input and one for the output to drain at a time. Both are resumed
+    // when the connection closes, a connection_ref held by the coroutine
+    // keeps it alive until then. Input is copied out of the buffer, so splice
+    // mode is dropped for it.
+    struct read_awaitable {
+        connection& con;
+        std::span<char> buf;
+        size_t wanted;
+
+        bool await_ready() {
+            return con.poll_input(wanted);
+        }
+
+        void await_suspend(std::coroutine_handle<> coro) {
+            con.reader = coro;
+            con.reader_wants = wanted;
+            con.set_read_state(true);
+        }
+
+        // Bytes copied to buf, fewer than wanted only at the end of input or
+        // once closed.
+        size_t await_resume() {
+            return con.take_input(buf);
+        }
+    };
+
+    struct write_awaitable {
+        connection& con;
+
+        bool await_ready() const {
+            return con.closed || con.output_size() == 0;
+        }
+
+        void await_suspend(std::coroutine_handle<> coro) {
+            con.writer = coro;
+        }
+
+        // false if the connection closed before all the data went out.
+        bool await_resume() const {
+            return !con.closed;
+        }
+    };
+
+    // co_await con.read_some(buf) waits until there is input.
+    read_awaitable read_some(std::span<char> buf) {
+        return {*this, buf, 1};
+    }
+
+    // co_await con.read_exact(buf) waits until buf can be filled, buf must
+    // be smaller than the input buffer limit.
+    read_awaitable read_exact(std::span<char> buf) {
+        return {*this, buf, buf.size()};
+    }
+
+    // co_await con.write_all(data) queues the data and waits until the socket
+    // has taken all the output.
+    write_awaitable write_all(std::string_view data) {
+        write(data);
+        return {*this};
+    }
+
+    bool is_closed() const {
+        return closed;
+    }
+
     void add_to_ios(int listen_events) {
         events = listen_events;
-        ios->add(sock, events, std::bind(&connection::parse_event, this, std::placeholders::_1));
+        ios->add(sock, events, this);
     }
 
     void set_events(int new_events) {
+        if (new_events == events) {
+            return;
+        }
+        int enabled = new_events & ~events;
         events = new_events;
         ios->change(sock, new_events);
+
+        // No new edge will come for readiness we have already seen.
+        if (ios->is_edge_triggered()) {
+            int ready = enabled & ((readable ? EPOLLIN : 0) | (writable ? EPOLLOUT : 0));
+            if (ready != 0) {
+                ios->post(this, ready);
+            }
+        }
     }
 
-    std::string read() {
-        std::string res;
-        char buf[1500];
+    // From now on input and output are kept in pipes and moved with splice()
+    // where the other fd supports it (see transfer_input() and output_from()),
+    // the ring buffers are only used when a pipe is full or as a fallback.
+    // Data in a pipe is always older than data in the matching ring buffer.
+    void enable_splice() {
+        in_pipe.reset(new splice_pipe(MAX_INPUT_BUFFER));
+        out_pipe.reset(new splice_pipe(high_watermark));
+        if (!in_pipe->is_valid() || !out_pipe->is_valid()) {
+            in_pipe.reset();
+            out_pipe.reset();
+        }
+    }
 
-        int cnt;
-        while (true) {
-            cnt = recv(sock, buf, sizeof(buf), 0);
-            printf("recv()-> %d, errno=%d\n", cnt, errno);
+    // Reads everything the socket has into the input buffer, returns the
+    // number of new bytes. Handlers get the data through input() or
+    // transfer_input().
+    size_t read() {
+        if (closed) {
+            return 0;
+        }
+        size_t total = 0;
+        while (input_size() < MAX_INPUT_BUFFER) {
+            ssize_t cnt;
+            if (in_pipe && in_buf.empty() && in_pipe->available() != 0) {
+                cnt = in_pipe->fill(sock);
+                if (cnt == -1 && errno == EINVAL) {
+                    stop_splicing(in_pipe, in_buf);
+                    continue;
+                } else if (cnt == -1 && errno == EAGAIN && in_pipe->size() != 0) {
+                    // The pipe may be out of slots, that says nothing about the socket.
+                    cnt = in_buf.read_from(sock);
+                }
+            } else {
+                cnt = in_buf.read_from(sock);
+            }
+            LOG_TRACE("read()-> %zd, errno=%d", cnt, errno);
             if (cnt == 0) {
-                call_handlers(on_read_eof);
+                read_eof = true;
+                break;
             } else if (cnt != -1) {
-                res += std::string({buf, static_cast<unsigned long>(cnt)});
-                printf("recv() data[end]=%d, data[end+1]=%d\n", buf[cnt - 1], buf[cnt]);
+                total += cnt;
+                last_read = ios->now();
             } else if (errno == EAGAIN) {
+                readable = false;
+                break;
+            } else if (errno != EINTR) {
+                // A reset peer is as gone as a closed one, the server goes on.
+                if (errno != ECONNRESET) {
+                    perror("read()");
+                }
+                read_eof = true;
                 break;
-            } else {
-                perror("read()");
-                exit(errno);
             }
         }
-        return res;
+        return total;
     }
 
-    // int write(char* buffer, size_t buffer_size) {
-    //     int cnt = send(sock, buffer, buffer_size, MSG_NOSIGNAL);
-    //     printf("send() -> %d\n", cnt);
-    //     return cnt;
-    // }
+    ring_buffer& input() {
+        return in_buf;
+    }
 
-    int write(std::string const& data) {
-        int cnt = send(sock, data.data(), data.size(), MSG_NOSIGNAL);
-        printf("send() -> %d\n", cnt);
-        return cnt;
+    size_t input_size() const {
+        return in_buf.size() + (in_pipe ? in_pipe->size() : 0);
+    }
+
+    // Moves a piece of the buffered input to fd, same result as write().
+    ssize_t transfer_input(int fd) {
+        if (in_pipe && in_pipe->size() != 0) {
+            ssize_t cnt = in_pipe->drain(fd);
+            if (cnt != -1 || errno != EINVAL) {
+                return cnt;
+            }
+            stop_splicing(in_pipe, in_buf);
+        }
+        return in_buf.write_to(fd);
+    }
+
+    // Queues the data and sends as much of it as the socket takes right now,
+    // the rest goes out on EPOLLOUT.
+    void write(std::string_view data) {
+        if (write_failed) {
+            return;
+        }
+        out_buf.append(data);
+        flush();
+    }
+
+    // Producers may fill the output queue directly (e.g. with read_from()
+    // or output_from()) and call flush() afterwards.
+    ring_buffer& output() {
+        return out_buf;
+    }
+
+    size_t output_size() const {
+        return out_buf.size() + (out_pipe ? out_pipe->size() : 0);
+    }
+
+    // Queues whatever fd has to read, same result as read().
+    ssize_t output_from(int fd) {
+        if (out_pipe && out_buf.empty() && out_pipe->available() != 0) {
+            ssize_t cnt = out_pipe->fill(fd);
+            if (cnt == -1 && errno == EAGAIN && out_pipe->size() != 0) {
+                // The pipe may be out of slots, that says nothing about fd.
+                return out_buf.read_from(fd);
+            } else if (cnt != -1 || errno != EINVAL) {
+                return cnt;
+            }
+            stop_splicing(out_pipe, out_buf);
+        }
+        return out_buf.read_from(fd);
+    }
+
+    void flush() {
+        if (closed) {
+            return;
+        }
+        bool blocked = false;
+        while (out_pipe && out_pipe->size() != 0) {
+            ssize_t cnt = out_pipe->drain(sock);
+            LOG_TRACE("splice() -> %zd", cnt);
+            if (cnt > 0) {
+                last_write = ios->now();
+            } else if (cnt == -1) {
+                if (errno == EINTR) {
+                    continue;
+                } else if (errno == EAGAIN) {
+                    writable = false;
+                    blocked = true;
+                } else if (errno == EINVAL) {
+                    stop_splicing(out_pipe, out_buf);
+                } else {
+                    if (errno != EPIPE && errno != ECONNRESET) {
+                        perror("splice()");
+                    }
+                    write_failed = true;
+                    out_pipe.reset();
+                    out_buf.consume(out_buf.size());
+                }
+                break;
+            }
+        }
+
+        while (!blocked && !out_buf.empty()) {
+            ssize_t cnt = out_buf.send_to(sock, MSG_NOSIGNAL);
+            LOG_TRACE("sendmsg() -> %zd", cnt);
+            if (cnt > 0) {
+                last_write = ios->now();
+            } else if (cnt == -1) {
+                if (errno == EINTR) {
+                    continue;
+                } else if (errno == EAGAIN) {
+                    writable = false;
+                } else {
+                    // The peer is gone, EPOLLHUP/EPOLLERR will close the
+                    // connection. Until then producers see it as paused.
+                    if (errno != EPIPE && errno != ECONNRESET) {
+                        perror("sendmsg()");
+                    }
+                    write_failed = true;
+                    out_buf.consume(out_buf.size());
+                }
+                break;
+            }
+        }
+
+        size_t queued = output_size();
+        if ((queued == 0) == static_cast<bool>(events & EPOLLOUT)) {
+            set_write_state(queued != 0);
+        }
+        if (queued != 0 && write_timeout != 0 && !write_timer.is_active()) {
+            last_write = ios->now();
+            ios->schedule(write_timer, write_timeout);
+        }
+
+        if (!write_paused && queued >= high_watermark) {
+            write_paused = true;
+            call_handlers(on_write_high);
+        } else if (write_paused && queued <= low_watermark) {
+            write_paused = false;
+            call_handlers(on_write_low);
+        }
+        if (closing && output_size() == 0) {
+            close();
+        }
+    }
+
+    // Closes the connection once everything queued so far has been sent,
+    // right away if nothing is. The connection may be gone when it returns.
+    void close_after_flush() {
+        closing = true;
+        flush();
+    }
+
+    // on_write_high handlers are called once the output queue grows to high
+    // bytes, on_write_low ones when it drains back to low bytes.
+    void set_write_watermarks(size_t low, size_t high) {
+        low_watermark = low;
+        high_watermark = high;
+    }
+
+    // True from on_write_high until on_write_low, and for good once the
+    // peer refuses the data.
+    bool is_write_paused() const {
+        return write_paused || write_failed;
+    }
+
+    void add_on_write_high_handler(confunc_t func) {
+        on_write_high.push_back(func);
+    }
+
+    void add_on_write_low_handler(confunc_t func) {
+        on_write_low.push_back(func);
+    }
+
+    // The timeouts are in milliseconds, 0 turns one off. Expired timeouts
+    // call the on_timeout handlers, or close the connection if there are none.
+    // Idle: no traffic in any direction.
+    void set_idle_timeout(uint64_t ms) {
+        idle_timeout = ms;
+        last_read = last_write = ios->now();
+        arm(idle_timer, idle_timeout, [this]() {
+            check_deadline(idle_timer, idle_timeout, std::max(last_read, last_write));
+        });
+    }
+
+    // Read: nothing received from the peer.
+    void set_read_timeout(uint64_t ms) {
+        read_timeout = ms;
+        last_read = ios->now();
+        arm(read_timer, read_timeout, [this]() {
+            check_deadline(read_timer, read_timeout, last_read);
+        });
+    }
+
+    // Write: queued output makes no progress.
+    void set_write_timeout(uint64_t ms) {
+        write_timeout = ms;
+        write_timer.callback = [this]() {
+            if (output_size() != 0) {
+                check_deadline(write_timer, write_timeout, last_write);
+            }
+        };
+        if (write_timeout == 0) {
+            ios->cancel(write_timer);
+        }
+    }
+
+    void add_on_timeout_handler(confunc_t func) {
+        on_timeout.push_back(func);
     }
 
     void close() {
-        printf("closing connection, sock=%d\n", sock);
+        if (closed) {
+            return;
+        }
+        LOG_DEBUG("closing connection, sock=%d", sock);
+        closed = true;
+        ios->cancel(idle_timer);
+        ios->cancel(read_timer);
+        ios->cancel(write_timer);
         ios->remove(sock);
+        // Handlers may close the connection while it is still dispatching
+        // an event, handle_events() destroys it on the way out then.
+        bool was_dispatching = dispatching;
+        dispatching = true;
         call_handlers(on_close);
+        resume(reader);
+        resume(writer);
+        dispatching = was_dispatching;
         ::close(sock);
-        delete this;
+        if (!dispatching && refs == 0) {
+            destroy();
+        }
     }
 
     void set_read_state(bool new_state) {
@@ -218,48 +767,248 @@ protected:
     connection() : connection(-1, nullptr) {};
     connection(int sock, io_service* ios) : sock(sock), ios(ios) {};
 
-    void parse_event(int events) {
-        printf("[handler, sock=%d, events=%d IN]\n", sock, events);
-        if (events & EPOLLRDHUP) {
-            printf("EPOLLRDHUP\n");
+    void handle_events(int events) override {
+        LOG_TRACE("[handler, sock=%d, events=%d IN]", sock, events);
+        if (ios->is_edge_triggered()) {
+            readable |= (events & EPOLLIN) != 0;
+            writable |= (events & EPOLLOUT) != 0;
+            events &= this->events | EPOLLRDHUP | EPOLLHUP | EPOLLERR;
+        }
+        dispatching = true;
+        if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            LOG_TRACE("EPOLLRDHUP/EPOLLHUP/EPOLLERR");
             close();
         } else {
-            if (events & EPOLLERR) {
-                printf("EPOLLERR\n");
-            }
-
             if (events & EPOLLIN) {
-                printf("EPOLLIN\n");
+                LOG_TRACE("EPOLLIN");
                 call_handlers(on_read_ready);
+                if (read_eof && !closed) {
+                    call_handlers(on_read_eof);
+                }
+                if (reader && !closed && poll_input(reader_wants)) {
+                    resume(reader);
+                } else if (!reader && refs != 0 && !closed) {
+                    // Nobody takes the input now, level-triggered events
+                    // would keep coming until somebody does.
+                    set_read_state(false);
+                }
             }
 
-            if (events & EPOLLOUT) {
-                printf("EPOLLOUT\n");
-                call_handlers(on_write_ready);
+            if ((events & EPOLLOUT) && !closed) {
+                LOG_TRACE("EPOLLOUT");
+                flush();
+                if (!closed) {
+                    call_handlers(on_write_ready);
+                }
+                if (writer && !closed && output_size() == 0) {
+                    resume(writer);
+                }
             }
         }
-        printf("[handler OUT]\n");
+        dispatching = false;
+        LOG_TRACE("[handler OUT]");
+        if (closed && refs == 0) {
+            destroy();
+        }
     };
 
 private:
-    void call_handlers(std::vector<confunc_t> const& handlers) {
-        for(auto handler: handlers) {
-            handler(*this);
+    // Falls back to the ring buffer for good. Whatever is still in the pipe
+    // is older than the buffered data, so it goes in front of it.
+    static void stop_splicing(std::unique_ptr<splice_pipe>& pipe, ring_buffer& buf) {
+        ring_buffer merged(pipe->size() + buf.size());
+        pipe->drain(merged);
+        std::string_view spans[2];
+        int num = buf.data(spans);
+        for (int i = 0; i < num; ++i) {
+            merged.append(spans[i]);
+        }
+        buf = std::move(merged);
+        pipe.reset();
+    }
+
+    // Whether a coroutine waiting for wanted bytes can go on now, reads the
+    // socket if needed.
+    bool poll_input(size_t wanted) {
+        if (in_pipe) {
+            stop_splicing(in_pipe, in_buf);
         }
+        if (in_buf.size() < wanted && !closed && !read_eof && (readable || !ios->is_edge_triggered())) {
+            read();
+        }
+        return in_buf.size() >= wanted || closed || read_eof;
     }
 
+    size_t take_input(std::span<char> buf) {
+        std::string_view spans[2];
+        int num = in_buf.data(spans);
+        size_t total = 0;
+        for (int i = 0; i < num && total < buf.size(); ++i) {
+            size_t cnt = std::min(spans[i].size(), buf.size() - total);
+            memcpy(buf.data() + total, spans[i].data(), cnt);
+            total += cnt;
+        }
+        in_buf.consume(total);
+        return total;
+    }
+
+    static void resume(std::coroutine_handle<>& coro) {
+        if (coro) {
+            auto waiting = coro;
+            coro = nullptr;
+            waiting.resume();
+        }
+    }
+
+    void release_ref() {
+        if (--refs == 0 && closed && !dispatching) {
+            destroy();
+        }
+    }
+
+    void arm(timer& t, uint64_t timeout, timer::timerfunc_t func) {
+        t.callback = func;
+        if (timeout == 0) {
+            ios->cancel(t);
+        } else {
+            ios->schedule(t, timeout);
+        }
+    }
+
+    // Activity only updates the timestamps, the timer catches up with them
+    // when it fires instead of being moved on every read or write.
+    void check_deadline(timer& t, uint64_t timeout, uint64_t last_activity) {
+        uint64_t now = ios->now();
+        if (now - last_activity < timeout) {
+            ios->schedule(t, last_activity + timeout - now);
+            return;
+        }
+        LOG_DEBUG("timeout, sock=%d", sock);
+        if (on_timeout.empty()) {
+            close();
+        } else {
+            call_handlers(on_timeout);
+        }
+    }
+
+    void destroy() {
+        if (pool != nullptr) {
+            pool->release(this);
+        } else {
+            delete this;
+        }
+    }
+
+    void call_handlers(handlers_t const& handlers) {
+        for (size_t i = 0; i < handlers.size(); ++i) {
+            handlers[i](*this);
+            if (closed && &handlers != &on_close) {
+                break;
+            }
+        }
+    }
+
+    // read() stops filling the input buffer at this size, the rest stays
+    // in the socket until the buffered data is consumed.
+    static const size_t MAX_INPUT_BUFFER = 1 << 20;
+
     int sock, events;
+    bool dispatching = false, closed = false, read_eof = false, write_paused = false;
+    bool closing = false;       // see close_after_flush()
+    bool write_failed = false;
+    bool readable = false, writable = false;     // edge-triggered mode only
+    size_t low_watermark = 64 * 1024, high_watermark = 256 * 1024;
+    ring_buffer in_buf, out_buf;
+    std::unique_ptr<splice_pipe> in_pipe, out_pipe;
+    timer idle_timer, read_timer, write_timer;
+    uint64_t idle_timeout = 0, read_timeout = 0, write_timeout = 0;
+    uint64_t last_read = 0, last_write = 0;
     io_service* ios;
-    std::vector<confunc_t> on_read_ready, on_write_ready, on_close, on_read_eof;
+    object_pool<connection>* pool = nullptr;
+    std::coroutine_handle<> reader, writer;
+    size_t reader_wants = 0;
+    size_t refs = 0;        // connection_refs, see below
+    handlers_t on_read_ready, on_write_ready, on_close, on_read_eof;
+    handlers_t on_write_high, on_write_low, on_timeout;
+};
+
+
+// Keeps a connection from being destroyed when it closes, until the last
+// reference goes away. Coroutines take the connection they drive as one:
+//     task echo(connection_ref con) {
+//         char buf[4096];
+//         while (size_t cnt = co_await con->read_some(buf)) {
+//             if (!co_await con->write_all({buf, cnt})) break;
+//         }
+//         con->close();
+//     }
+struct connection_ref {
+    explicit connection_ref(connection& con) : con(&con) {
+        ++con.refs;
+    }
+
+    connection_ref(connection_ref&& other) : con(other.con) {
+        other.con = nullptr;
+    }
+
+    connection_ref(connection_ref const&) = delete;
+
+    ~connection_ref() {
+        if (con != nullptr) {
+            con->release_ref();
+        }
+    }
+
+    connection* operator->() const {
+        return con;
+    }
+
+    connection& operator*() const {
+        return *con;
+    }
+
+private:
+    connection* con;
+};
+
+
+// Return type of coroutines that are started and forgotten: the coroutine
+// runs up to its first suspension right away and frees its frame itself.
+struct task {
+    struct promise_type {
+        task get_return_object() {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
 };
 
 
 struct tcp_server {
-    tcp_server(io_service& io_service, int port) : ios(io_service) {
+    static const int DEFAULT_BACKLOG = 1000;
+    static const int DEFAULT_ACCEPT_BUDGET = 64;
+
+    // accept_budget limits the connections accepted per loop iteration, so
+    // that a connection storm does not starve the established sessions.
+    tcp_server(io_service& io_service, int port, int backlog = DEFAULT_BACKLOG,
+               int accept_budget = DEFAULT_ACCEPT_BUDGET) : ios(io_service), accept_budget(accept_budget) {
         sockaddr_in srv_addr;
         bzero(&srv_addr, sizeof(srv_addr));
 
-        int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+        int listen_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
         srv_addr.sin_family = AF_INET;
         srv_addr.sin_port = htons(port);
         srv_addr.sin_addr.s_addr = INADDR_ANY;
@@ -267,18 +1016,44 @@ struct tcp_server {
         int optval = 1;
         setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR,
                    &optval, sizeof(optval));
+        // Every loop of an io_service_pool gets its own listening socket on
+        // the same port, the kernel balances incoming connections between them.
+        setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT,
+                   &optval, sizeof(optval));
 
-        bind(listen_sock, (sockaddr*)(&srv_addr), sizeof(srv_addr));
-        listen(listen_sock, 1000);
+        if (bind(listen_sock, (sockaddr*)(&srv_addr), sizeof(srv_addr)) == -1) {
+            perror("bind()");
+            exit(errno);
+        }
+        listen(listen_sock, backlog);
 
         listen_conn = connection(listen_sock, &ios);
-        printf("tcp_server, before add_on_read_ready_handler\n");
         listen_conn.add_on_read_ready_handler([this](connection& conn) {
-            int in_sock = accept(conn.get_fd(), nullptr, nullptr);
-            fcntl(in_sock, F_SETFL, O_NONBLOCK);
+            for (int i = 0; i < this->accept_budget; ++i) {
+                int in_sock = accept4(conn.get_fd(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (in_sock == -1) {
+                    if (errno == EINTR || errno == ECONNABORTED) {
+                        continue;
+                    } else if (errno != EAGAIN) {
+                        LOG_ERROR("accept4() error %d", errno);
+                    }
+                    return;
+                }
 
-            // TODO: this is not thread-safe (e.g. events could be called before on_new_connection(...))
-            on_new_connection(construct_connection(in_sock, EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP));
+                // Sessions are interactive: a prompt written right after the
+                // output must not wait for the ACK of the output.
+                int nodelay = 1;
+                setsockopt(in_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+                // TODO: this is not thread-safe (e.g. events could be called before on_new_connection(...))
+                on_new_connection(construct_connection(in_sock, EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP));
+            }
+
+            // The budget is spent but the backlog may be not empty. An edge is
+            // reported only once, so come back after the current batch.
+            if (ios.is_edge_triggered()) {
+                ios.post(&conn, EPOLLIN);
+            }
         });
 
         listen_conn.add_to_ios(EPOLLIN);
@@ -295,16 +1070,16 @@ struct tcp_server {
         hints.ai_family = AF_INET;
         hints.ai_socktype = SOCK_STREAM;
 
-        printf("getaddrinfo - in <- %s\n", addr);
+        LOG_DEBUG("getaddrinfo - in <- %s", addr);
         int res = getaddrinfo(addr, 0, &hints, &r);
         if (res != 0)
-            printf("error %d, %d\n", res, errno);
+            LOG_ERROR("getaddrinfo() error %d, %d", res, errno);
         ((sockaddr_in*)(r->ai_addr))->sin_port = htons(port);
-        printf("getaddrinfo - out\n");
+        LOG_DEBUG("getaddrinfo - out");
 
         int sock = socket(AF_INET, SOCK_STREAM, SOCK_NONBLOCK);
         if (connect(sock, r->ai_addr, r->ai_addrlen) == -1) {
-            printf("connect() error %d\n", errno);
+            LOG_ERROR("connect() error %d", errno);
         }
 
         return construct_connection(sock, EPOLLIN | EPOLLOUT | EPOLLRDHUP);
@@ -321,11 +1096,15 @@ protected:
 
 private:
     connection& construct_connection(int sock, int events) {
-        connection* new_conn = new connection(sock, &ios);
+        connection* new_conn = conn_pool.acquire(sock, &ios);
+        new_conn->pool = &conn_pool;
         new_conn->add_to_ios(events);
         return *new_conn;
     }
 
+    int accept_budget;
+    // Connections of this server, the server belongs to one loop.
+    object_pool<connection> conn_pool;
     connection listen_conn;
 };
 
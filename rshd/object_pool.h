@@ -0,0 +1,67 @@
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <stddef.h>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+
+// Fixed-size object slots carved from chunks that are never freed or moved:
+// acquire() and release() are O(1) free list operations and objects keep
+// their address. Not thread-safe, every loop owns its pools.
+template<typename T, size_t CHUNK_SIZE = 64>
+struct object_pool {
+    object_pool() : free_list(nullptr), used(0) {};
+
+    object_pool(object_pool const&) = delete;
+
+    template<typename... Args>
+    T* acquire(Args&&... args) {
+        if (free_list == nullptr) {
+            grow();
+        }
+        slot* s = free_list;
+        free_list = s->next;
+        ++used;
+        return new (s->storage) T(std::forward<Args>(args)...);
+    }
+
+    void release(T* obj) {
+        obj->~T();
+        slot* s = reinterpret_cast<slot*>(obj);
+        s->next = free_list;
+        free_list = s;
+        --used;
+    }
+
+    size_t size() const {
+        return used;
+    }
+
+    size_t capacity() const {
+        return chunks.size() * CHUNK_SIZE;
+    }
+
+private:
+    union slot {
+        slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    void grow() {
+        chunks.emplace_back(new slot[CHUNK_SIZE]);
+        slot* chunk = chunks.back().get();
+        for (size_t i = CHUNK_SIZE; i > 0; --i) {
+            chunk[i - 1].next = free_list;
+            free_list = &chunk[i - 1];
+        }
+    }
+
+    slot* free_list;
+    size_t used;
+    std::vector<std::unique_ptr<slot[]>> chunks;
+};
+
+#endif
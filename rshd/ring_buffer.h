@@ -0,0 +1,187 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <string_view>
+
+
+// Growable byte ring. Data is filled straight from an fd with readv() and
+// handed out as (at most two) string_views over the storage, so nothing is
+// copied between the kernel and the consumer.
+struct ring_buffer {
+    explicit ring_buffer(size_t capacity = 4096) : cap(round_up(capacity)), head(0), tail(0), storage(new char[cap]) {};
+
+    ring_buffer(ring_buffer const&) = delete;
+    ring_buffer(ring_buffer&&) = default;
+    ring_buffer& operator=(ring_buffer&&) = default;
+
+    size_t size() const {
+        return tail - head;
+    }
+
+    bool empty() const {
+        return head == tail;
+    }
+
+    size_t capacity() const {
+        return cap;
+    }
+
+    size_t available() const {
+        return cap - size();
+    }
+
+    // Stored data as up to two contiguous pieces, returns their number.
+    int data(std::string_view spans[2]) const {
+        size_t begin = head & (cap - 1), len = size();
+        if (len == 0) {
+            return 0;
+        }
+        size_t first = std::min(len, cap - begin);
+        spans[0] = std::string_view(&storage[begin], first);
+        if (first == len) {
+            return 1;
+        }
+        spans[1] = std::string_view(&storage[0], len - first);
+        return 2;
+    }
+
+    // The first contiguous piece of stored data.
+    std::string_view front() const {
+        std::string_view spans[2];
+        return data(spans) == 0 ? std::string_view() : spans[0];
+    }
+
+    void consume(size_t cnt) {
+        head += cnt;
+        if (head == tail) {
+            head = tail = 0;
+        }
+    }
+
+    void append(const char* buf, size_t cnt) {
+        reserve(cnt);
+        iovec iov[2];
+        int num = free_space(iov);
+        for (int i = 0; i < num && cnt > 0; ++i) {
+            size_t part = std::min(cnt, iov[i].iov_len);
+            memcpy(iov[i].iov_base, buf, part);
+            buf += part;
+            cnt -= part;
+            tail += part;
+        }
+    }
+
+    void append(std::string_view str) {
+        append(str.data(), str.size());
+    }
+
+    // Makes room for at least cnt more bytes.
+    void reserve(size_t cnt) {
+        if (available() >= cnt) {
+            return;
+        }
+        size_t new_cap = cap;
+        while (new_cap - size() < cnt) {
+            new_cap *= 2;
+        }
+
+        std::unique_ptr<char[]> new_storage(new char[new_cap]);
+        std::string_view spans[2];
+        int num = data(spans);
+        size_t len = 0;
+        for (int i = 0; i < num; ++i) {
+            memcpy(&new_storage[len], spans[i].data(), spans[i].size());
+            len += spans[i].size();
+        }
+        storage = std::move(new_storage);
+        cap = new_cap;
+        head = 0;
+        tail = len;
+    }
+
+    // One readv() into the free space, growing the buffer when it is full.
+    ssize_t read_from(int fd) {
+        if (available() == 0) {
+            reserve(cap);
+        }
+        iovec iov[2];
+        int num = free_space(iov);
+        ssize_t cnt = readv(fd, iov, num);
+        if (cnt > 0) {
+            tail += cnt;
+        }
+        return cnt;
+    }
+
+    // One writev() of the stored data, written bytes are consumed.
+    ssize_t write_to(int fd) {
+        iovec iov[2];
+        int num = to_iovecs(iov);
+        ssize_t cnt = writev(fd, iov, num);
+        if (cnt > 0) {
+            consume(cnt);
+        }
+        return cnt;
+    }
+
+    // The same for sockets, so that flags like MSG_NOSIGNAL can be passed.
+    ssize_t send_to(int sock, int flags) {
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        iovec iov[2];
+        msg.msg_iov = iov;
+        msg.msg_iovlen = to_iovecs(iov);
+        ssize_t cnt = sendmsg(sock, &msg, flags);
+        if (cnt > 0) {
+            consume(cnt);
+        }
+        return cnt;
+    }
+
+    int to_iovecs(iovec iov[2]) const {
+        std::string_view spans[2];
+        int num = data(spans);
+        for (int i = 0; i < num; ++i) {
+            iov[i].iov_base = const_cast<char*>(spans[i].data());
+            iov[i].iov_len = spans[i].size();
+        }
+        return num;
+    }
+
+private:
+    static size_t round_up(size_t capacity) {
+        size_t res = 1;
+        while (res < capacity) {
+            res *= 2;
+        }
+        return res;
+    }
+
+    int free_space(iovec iov[2]) {
+        size_t begin = tail & (cap - 1), len = available();
+        if (len == 0) {
+            return 0;
+        }
+        size_t first = std::min(len, cap - begin);
+        iov[0].iov_base = &storage[begin];
+        iov[0].iov_len = first;
+        if (first == len) {
+            return 1;
+        }
+        iov[1].iov_base = &storage[0];
+        iov[1].iov_len = len - first;
+        return 2;
+    }
+
+    size_t cap;
+    size_t head, tail;      // only grow, positions are taken modulo cap
+    std::unique_ptr<char[]> storage;
+};
+
+#endif
@@ -1,5 +1,8 @@
 #define _XOPEN_SOURCE 600
 #include "networking.h"
+#include "shell_pool.h"
+#include "mux.h"
+#include "deflate_stream.h"
 #include <sys/wait.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
@@ -10,171 +13,357 @@
 #include <stropts.h>
 #include <string.h>
 #include <stdio.h>
-#include <unordered_map>
 
 
 
 const static char PID_FILE[] = "/tmp/rshd.pid";
+// MCCP v2 (telnet option 86), enabled with -z: every raw session starts with
+// IAC WILL COMPRESS2. A client that answers IAC DO COMPRESS2 gets
+// IAC SB COMPRESS2 IAC SE back, and everything after it is one zlib stream.
+// IAC DONT COMPRESS2 or any other input leaves the session uncompressed.
+// Client input is never compressed, mux sessions (-m) are not covered.
+const static char MCCP_WILL[] = "\xff\xfb\x56";
+const static char MCCP_DO[] = "\xff\xfd\x56";
+const static char MCCP_DONT[] = "\xff\xfe\x56";
+const static char MCCP_START[] = "\xff\xfa\x56\xff\xf0";
+const static char USAGE[] = "Usage: rshd [-e] [-s] [-u] [-z level] [-m mux_port] [-i idle_seconds] [-p shell_pool_size] [-b backlog] [-a accept_budget] [-t threads] [-l trace|debug|info|warning|error] [port | stop]\n";
+
+
+struct rshd_data: io_handler {
+    const static int BUFFER_SIZE = 1500;
+    // Client input waiting for the pty above this size pauses socket reads.
+    const static size_t MAX_PENDING_INPUT = 64 * 1024;
+    // Compressed output is flushed at least this often, even if the pty
+    // never runs dry.
+    const static size_t COMPRESS_FLUSH_BYTES = 64 * 1024;
+
+    rshd_data(io_service& ios, connection& con, shell_process const& shell, uint64_t started, int compress_level)
+            : ptymfd(shell.ptymfd), shell(shell), started(started), compress_level(compress_level), ios(ios),
+              client_con(con) {
+        pty_events = EPOLLIN | EPOLLRDHUP;
+        ios.add(ptymfd, pty_events, this);
+        negotiating = compress_level != 0;
+        if (negotiating) {
+            client_con.write({MCCP_WILL, sizeof(MCCP_WILL) - 1});
+        }
+    }
 
+    ~rshd_data() {
+        if (!hung_up) {
+            ios.remove(ptymfd);
+        } else {
+            ios.forget(this);
+        }
+        if (compressor) {
+            LOG_DEBUG("%d - compressed %zu bytes to %zu", client_con.get_fd(), compressor->total_in(),
+                      compressor->total_out());
+        }
+        LOG_DEBUG("Terminating shell %d, %s calls on this loop: %zu", shell.pid, ios.backend_name(),
+                  ios.backend_calls());
+        end_shell(ios, shell);
+        close(ptymfd);
+    }
 
-struct rshd_data {
-    const static int BUFFER_SIZE = 1500;
 
-    rshd_data(io_service& ios, connection& con) : ios(ios), client_con(con) {
-        ptymfd = posix_openpt(O_RDWR);
-        grantpt(ptymfd);
-        unlockpt(ptymfd);
-        ptysfd = open(ptsname(ptymfd), O_RDWR);
+    void handle_events(int event) override {
+        if (ios.is_edge_triggered()) {
+            pty_readable |= (event & EPOLLIN) != 0;
+            pty_writable |= (event & EPOLLOUT) != 0;
+            event &= pty_events | EPOLLHUP | EPOLLERR;
+        }
+        if (event & EPOLLOUT) {
+            LOG_TRACE("pty EPOLLOUT");
+            pump_input();
+        }
+        if (event & ~(EPOLLIN|EPOLLOUT|EPOLLHUP)) {
+            LOG_WARNING("pty UNKNOWN event: %d", event);
+        }
+        if (event & EPOLLHUP) {
+            hang_up();
+        } else if (event & EPOLLIN) {
+            LOG_TRACE("pty EPOLLIN");
+            pump_output(false);
+        }
+    }
 
-        pty_events = EPOLLIN | EPOLLRDHUP;
-        ios.add(ptymfd, pty_events, [this](int event) {
-            if (event & EPOLLOUT) {
-                printf("pty EPOLLOUT\n");
-                if (buf_in.size() == 0) {
-                    enable_in(false);
-                } else {
-                    write(ptymfd, buf_in.data(), buf_in.size());
-                    buf_in.clear();
-                    // client_con.set_read_state(true);
+    // The shell is gone, but what it wrote last may still be in the pty and
+    // in the output queue. The pty would report the hangup forever, so it
+    // leaves the loop and is read until EIO whenever the connection takes
+    // more output. The connection closes once all of it has been sent, which
+    // may destroy this session.
+    void hang_up() {
+        if (!hung_up) {
+            LOG_DEBUG("pty EPOLLHUP");
+            hung_up = true;
+            ios.remove(ptymfd);
+        }
+        if (pump_output(true)) {
+            client_con.close_after_flush();
+        }
+    }
+
+    // Looks for the answer to MCCP_WILL at the start of the input, returns
+    // false while the input is a prefix of one. The answer itself does not
+    // go to the pty.
+    bool negotiate() {
+        const size_t answer_size = sizeof(MCCP_DO) - 1;
+        char head[answer_size];
+        std::string_view spans[2];
+        int num = client_con.input().data(spans);
+        size_t len = 0;
+        for (int i = 0; i < num && len < answer_size; ++i) {
+            size_t cnt = std::min(spans[i].size(), answer_size - len);
+            memcpy(head + len, spans[i].data(), cnt);
+            len += cnt;
+        }
+        bool is_do = memcmp(head, MCCP_DO, len) == 0;
+        bool is_dont = memcmp(head, MCCP_DONT, len) == 0;
+        if ((is_do || is_dont) && len < answer_size) {
+            return false;
+        }
+        negotiating = false;
+        if (is_do || is_dont) {
+            client_con.input().consume(answer_size);
+        }
+        if (is_do) {
+            LOG_DEBUG("%d - compressing output, level %d", client_con.get_fd(), compress_level);
+            client_con.write({MCCP_START, sizeof(MCCP_START) - 1});
+            compressor.reset(new deflate_stream(compress_level));
+        }
+        return true;
+    }
+
+    // Writes buffered client input to the pty. In level-triggered mode it is
+    // one write per event, in edge-triggered mode until EAGAIN.
+    void pump_input() {
+        bool was_full = client_con.input_size() >= MAX_PENDING_INPUT;
+        while (client_con.input_size() != 0) {
+            if (client_con.transfer_input(ptymfd) == -1) {
+                if (errno == EINTR) {
+                    continue;
                 }
+                pty_writable = false;
+                break;
             }
-            if (event & EPOLLIN) {
-                printf("pty EPOLLIN\n");
-                if (buf_out.size() != 0) {
-                    enable_out(false);
-                } else {
-                    char buf[1500];
-                    int cnt = read(ptymfd, buf, sizeof(buf));
-                    printf("pty read() -> %d\n", cnt);
-                    buf_out = std::string(buf, cnt);
-                    client_con.set_write_state(true);
-                }
+            if (!ios.is_edge_triggered()) {
+                break;
             }
-            if (event & EPOLLHUP) {
-                printf("pty EPOLLHUP\n");
-                client_con.close();
+        }
+        if (client_con.input_size() == 0) {
+            enable_in(false);
+        }
+        if (was_full && client_con.input_size() < MAX_PENDING_INPUT) {
+            client_con.set_read_state(true);
+        }
+    }
+
+    // Pty output goes straight to the client's output queue (spliced when the
+    // connection is in splice mode), the connection stops us through its high
+    // watermark if it grows. Returns true once the pty has nothing to read,
+    // drain reads it until then even when level-triggered.
+    bool pump_output(bool drain) {
+        if (compressor) {
+            return pump_compressed(drain);
+        }
+        while (pty_events & EPOLLIN) {
+            ssize_t cnt = client_con.output_from(ptymfd);
+            LOG_TRACE("pty read() -> %zd", cnt);
+            if (cnt == -1 && errno == EINTR) {
+                continue;
+            } else if (cnt <= 0) {
+                pty_readable = false;
+                return true;
             }
-            if (event & ~(EPOLLIN|EPOLLOUT|EPOLLHUP)) {
-                printf("pty UNKNOWN event: %d\n", event);
+            log_first_output();
+            client_con.flush();
+            if (!drain && !ios.is_edge_triggered()) {
+                break;
             }
-        });
-
-        fork_shell();
+        }
+        return false;
     }
 
-    ~rshd_data() {
-        ios.remove(ptymfd);
-        printf("Terminating shell...\n");
-        kill(shell, SIGINT);
-        close(ptymfd);
+    // The pty is read until it runs dry, then everything is flushed, so an
+    // interactive client gets each prompt at once. Bulk output is flushed
+    // every COMPRESS_FLUSH_BYTES, and that also ends the event in
+    // level-triggered mode. The socket is written only at the flushes.
+    bool pump_compressed(bool drain) {
+        char buf[16 * 1024];
+        size_t unflushed = 0;
+        bool is_empty = false;
+        while (pty_events & EPOLLIN) {
+            ssize_t cnt = ::read(ptymfd, buf, sizeof(buf));
+            LOG_TRACE("pty read() -> %zd", cnt);
+            if (cnt == -1 && errno == EINTR) {
+                continue;
+            } else if (cnt <= 0) {
+                pty_readable = false;
+                is_empty = true;
+                break;
+            }
+            unflushed += cnt;
+            bool flush = unflushed >= COMPRESS_FLUSH_BYTES;
+            compressor->compress({buf, static_cast<size_t>(cnt)}, flush, client_con.output());
+            if (flush) {
+                unflushed = 0;
+                client_con.flush();
+                if (!drain && !ios.is_edge_triggered()) {
+                    break;
+                }
+            }
+        }
+        if (unflushed != 0) {
+            compressor->compress({}, true, client_con.output());
+            client_con.flush();
+            log_first_output();
+        }
+        return is_empty;
     }
 
-
     void enable_in(bool new_state) {
+        if (hung_up) {
+            return;
+        }
         pty_events = (new_state ? pty_events | EPOLLOUT : pty_events & ~EPOLLOUT);
         ios.change(ptymfd, pty_events);
+        if (new_state && pty_writable) {
+            ios.post(this, EPOLLOUT);
+        }
     }
 
+    // Called from inside connection writes, so a hung up pty is drained
+    // through the loop.
     void enable_out(bool new_state) {
         pty_events = (new_state ? pty_events | EPOLLIN : pty_events & ~EPOLLIN);
+        if (hung_up) {
+            if (new_state) {
+                ios.post(this, EPOLLHUP);
+            }
+            return;
+        }
         ios.change(ptymfd, pty_events);
+        if (new_state && pty_readable) {
+            ios.post(this, EPOLLIN);
+        }
     }
 
 
-// private:
-    void fork_shell() {
-        pid_t child_pid = fork();
-        if (child_pid == -1) {
-            perror("fork()");
-            exit(errno);
-        } else if (child_pid == 0) {
-            struct termios slave_orig_term_settings; // Saved terminal settings
-            struct termios new_term_settings; // Current terminal settings
-
-            // Close the master side of the PTY
-            close(ptymfd);
-
-            // Save the default parameters of the slave side of the PTY
-            int rc = tcgetattr(ptysfd, &slave_orig_term_settings);
-
-            // Set raw mode on the slave side of the PTY
-            new_term_settings = slave_orig_term_settings;
-            cfmakeraw(&new_term_settings);
-            tcsetattr(ptysfd, TCSANOW, &new_term_settings);
-
-            // The slave side of the PTY becomes the standard input and outputs of the child process
-            close(0); // Close standard input (current terminal)
-            close(1); // Close standard output (current terminal)
-            close(2); // Close standard error (current terminal)
-
-            dup(ptysfd); // PTY becomes standard input (0)
-            dup(ptysfd); // PTY becomes standard output (1)
-            dup(ptysfd); // PTY becomes standard error (2)
-
-            setsid();
-            ioctl(0, TIOCSCTTY, 1);
-
-            if (execl("/bin/sh", "/bin/sh", 0) == -1) {
-                perror("execl()");
-                exit(errno);
-            }
-        } else {
-            close(ptysfd);
-            shell = child_pid;
+    void log_first_output() {
+        if (started != 0) {
+            LOG_INFO("%d - first prompt after %.3f ms", client_con.get_fd(), (now_us() - started) / 1000.0);
+            started = 0;
         }
     }
 
+    static uint64_t now_us() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    }
+
     int pty_events;
-    int ptymfd, ptysfd;
-    std::string buf_in, buf_out;
-    pid_t shell;
+    bool pty_readable = false, pty_writable = false;     // edge-triggered mode only
+    bool hung_up = false;
+    int ptymfd;
+    shell_process shell;
+    uint64_t started;       // connection time until the first output, in us
+    int compress_level;
+    bool negotiating;       // until the first input answers MCCP_WILL
+    std::unique_ptr<deflate_stream> compressor;
     io_service &ios;
     connection &client_con; //, &pipe_in, &pipe_out;
 };
 
 
 struct rshd: tcp_server {
-    rshd(io_service &ios, int port) : tcp_server(ios, port) {
+    rshd(io_service &ios, int port, int backlog, int accept_budget, shell_pool& shells, size_t loop,
+         bool use_splice, uint64_t idle_timeout, int compress_level)
+            : tcp_server(ios, port, backlog, accept_budget), shells(shells), loop(loop), use_splice(use_splice),
+              idle_timeout(idle_timeout), compress_level(compress_level) {
 
     }
 
     virtual ~rshd() = default;
 
     void on_new_connection(connection& new_con) {
-        printf("on_new_connection, sock=%d\n", new_con.get_fd());
-        cons.emplace(new_con.get_fd(), new rshd_data(ios, new_con));
-
-        new_con.add_on_read_ready_handler([this](connection& con) {
-            printf("%d - read_ready\n", con.get_fd());
-            rshd_data* data = cons.find(con.get_fd())->second;
-            data->buf_in = con.read();
-            // con.set_read_state(false);
-            data->enable_in(true);
+        LOG_DEBUG("on_new_connection, sock=%d", new_con.get_fd());
+        // The answer to the compression offer must be seen in the input
+        // buffer, so splicing starts after it.
+        if (use_splice && compress_level == 0) {
+            new_con.enable_splice();
+        }
+        // Idle sessions are closed, which takes the pty and the shell down.
+        new_con.set_idle_timeout(idle_timeout);
+        // Handlers capture the session itself, two pointers still fit into
+        // std::function without a heap allocation.
+        uint64_t started = rshd_data::now_us();
+        rshd_data* data = sessions.acquire(ios, new_con, shells.claim(loop), started, compress_level);
+
+        new_con.add_on_read_ready_handler([this, data](connection& con) {
+            LOG_TRACE("%d - read_ready", con.get_fd());
+            if (con.read() > 0) {
+                if (data->negotiating && data->negotiate() && use_splice) {
+                    con.enable_splice();
+                }
+                if (!data->negotiating && con.input_size() != 0) {
+                    data->enable_in(true);
+                }
+            }
+            if (con.input_size() >= rshd_data::MAX_PENDING_INPUT) {
+                con.set_read_state(false);
+            }
         });
 
-        new_con.add_on_eof_read_handler([this](connection& con) {
+        new_con.add_on_eof_read_handler([](connection& con) {
             con.close();
         });
 
-        new_con.add_on_write_ready_handler([this](connection& con) {
-           printf("%d - write_ready\n", con.get_fd());
-           rshd_data* data = cons.find(con.get_fd())->second;
-           con.write(data->buf_out);
-           data->buf_out.clear();
-           data->enable_out(true);
-           con.set_write_state(false);
+        new_con.add_on_write_high_handler([data](connection& con) {
+            LOG_TRACE("%d - output queue is full", con.get_fd());
+            data->enable_out(false);
+        });
+
+        new_con.add_on_write_low_handler([data](connection& con) {
+            LOG_TRACE("%d - output queue drained", con.get_fd());
+            data->enable_out(true);
         });
 
-        new_con.add_on_close_handler([this](connection& con) {
-            printf("%d - connection closed\n", con.get_fd());
-            auto it = cons.find(con.get_fd());
-            delete it->second;
-            cons.erase(it);
+        new_con.add_on_close_handler([this, data](connection& con) {
+            LOG_DEBUG("%d - connection closed", con.get_fd());
+            sessions.release(data);
         });
     }
 
 private:
-    std::unordered_map<int, rshd_data*> cons;
+    shell_pool& shells;
+    size_t loop;
+    bool use_splice;
+    uint64_t idle_timeout;
+    int compress_level;
+    object_pool<rshd_data> sessions;
+};
+
+
+// Sessions multiplexed over one connection, see mux.h. Raw sessions stay on
+// the main port for nc and telnet.
+struct mux_server: tcp_server {
+    mux_server(io_service &ios, int port, int backlog, int accept_budget, shell_pool& shells, size_t loop,
+               uint64_t idle_timeout)
+            : tcp_server(ios, port, backlog, accept_budget), shells(shells), loop(loop),
+              idle_timeout(idle_timeout) {
+
+    }
+
+    void on_new_connection(connection& new_con) {
+        LOG_DEBUG("mux on_new_connection, sock=%d", new_con.get_fd());
+        new_con.set_idle_timeout(idle_timeout);
+        mux_session::serve(connection_ref(new_con), ios, shells, loop);
+    }
+
+private:
+    shell_pool& shells;
+    size_t loop;
+    uint64_t idle_timeout;
 };
 
 
@@ -227,13 +416,54 @@ void daemonize() {
 }
 
 
-int main(int argc, char const *argv[]) {
+int main(int argc, char* const argv[]) {
     int port = 12345;
-    if (argc > 2) {
-        printf("Usage: rshd [port | stop]\n");
+    size_t threads = 0;
+
+    int opt;
+    log_level level;
+    bool edge_triggered = false;
+    bool use_splice = false;
+    bool use_uring = false;
+    uint64_t idle_timeout = 15 * 60;
+    int backlog = tcp_server::DEFAULT_BACKLOG, accept_budget = tcp_server::DEFAULT_ACCEPT_BUDGET;
+    size_t pool_size = 4;
+    int mux_port = 0;
+    int compress_level = 0;
+    while ((opt = getopt(argc, argv, "esuz:m:i:b:a:p:t:l:")) != -1) {
+        if (opt == 't') {
+            threads = atoi(optarg);
+        } else if (opt == 'e') {
+            edge_triggered = true;
+        } else if (opt == 's') {
+            use_splice = true;
+        } else if (opt == 'u') {
+            use_uring = true;
+        } else if (opt == 'z' && atoi(optarg) >= 1 && atoi(optarg) <= 9) {
+            compress_level = atoi(optarg);
+        } else if (opt == 'm') {
+            mux_port = atoi(optarg);
+        } else if (opt == 'i') {
+            idle_timeout = atoi(optarg);
+        } else if (opt == 'p') {
+            pool_size = atoi(optarg);
+        } else if (opt == 'b') {
+            backlog = atoi(optarg);
+        } else if (opt == 'a' && atoi(optarg) > 0) {
+            accept_budget = atoi(optarg);
+        } else if (opt == 'l' && logger::parse_level(optarg, level)) {
+            logger::set_level(level);
+        } else {
+            printf("%s", USAGE);
+            return 0;
+        }
+    }
+
+    if (argc - optind > 1) {
+        printf("%s", USAGE);
         return 0;
-    } else if (argc == 2) {
-        if (strcmp(argv[1], "stop") == 0) {
+    } else if (argc - optind == 1) {
+        if (strcmp(argv[optind], "stop") == 0) {
             int fd;
             if ((fd = open(PID_FILE, O_RDONLY)) < 0) {
                   perror("Pid file is not found. May be the server is not running?");
@@ -248,14 +478,28 @@ int main(int argc, char const *argv[]) {
             unlink(PID_FILE);
             return 0;
         } else {
-            port = atoi(argv[1]);
+            port = atoi(argv[optind]);
         }
     }
 
     // daemonize();
-    io_service ios;
-    rshd server(ios, port);
-    ios.run();
+    // splice() to a closed socket raises SIGPIPE, there is no MSG_NOSIGNAL for it
+    signal(SIGPIPE, SIG_IGN);
+    io_service_pool pool(threads, edge_triggered, use_uring);
+    // Forked here, before the loops start their threads.
+    shell_pool shells(pool_size, pool.size());
+    std::vector<std::unique_ptr<rshd>> servers;
+    std::vector<std::unique_ptr<mux_server>> mux_servers;
+    for (size_t i = 0; i < pool.size(); ++i) {
+        shells.attach(i, pool[i]);
+        servers.emplace_back(new rshd(pool[i], port, backlog, accept_budget, shells, i, use_splice,
+                                      idle_timeout * 1000, compress_level));
+        if (mux_port != 0) {
+            mux_servers.emplace_back(new mux_server(pool[i], mux_port, backlog, accept_budget, shells, i,
+                                                    idle_timeout * 1000));
+        }
+    }
+    pool.run();
 
     return 0;
 }
@@ -0,0 +1,390 @@
+#ifndef SHELL_POOL_H
+#define SHELL_POOL_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <memory>
+#include <vector>
+#include "launch.h"
+#include "networking.h"
+
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+
+// A started shell: the pty master (non-blocking, close-on-exec) and a pidfd
+// (close-on-exec) to signal it by, which cannot reach another process once
+// the pid is reused. A shell spawned by this process is its child and has
+// to be reaped, see end_shell().
+struct shell_process {
+    int ptymfd;
+    int pidfd;
+    pid_t pid;
+    bool is_child;
+};
+
+
+// Opens a pty and starts /bin/sh on its slave side.
+inline shell_process spawn_shell() {
+    shell_process sh;
+    sh.is_child = true;
+    sh.ptymfd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sh.ptymfd == -1) {
+        perror("posix_openpt()");
+        exit(errno);
+    }
+    fcntl(sh.ptymfd, F_SETFL, O_NONBLOCK);
+    fcntl(sh.ptymfd, F_SETFD, FD_CLOEXEC);
+    grantpt(sh.ptymfd);
+    unlockpt(sh.ptymfd);
+    char pts_name[64];
+    ptsname_r(sh.ptymfd, pts_name, sizeof(pts_name));
+
+    // Set raw mode on the slave side of the PTY before the shell opens it
+    int ptysfd = open(pts_name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    struct termios term_settings;
+    tcgetattr(ptysfd, &term_settings);
+    cfmakeraw(&term_settings);
+    tcsetattr(ptysfd, TCSANOW, &term_settings);
+
+    char shell[] = "/bin/sh";
+    char* const argv[] = {shell, nullptr};
+    sh.pid = spawn_actions().session_tty(pts_name).spawn(shell, argv);
+    if (sh.pid == -1) {
+        perror("posix_spawn()");
+        exit(errno);
+    }
+    close(ptysfd);
+    // Not reaped yet, so the pid is still this shell's
+    sh.pidfd = syscall(SYS_pidfd_open, sh.pid, 0);
+    if (sh.pidfd == -1) {
+        perror("pidfd_open()");
+        exit(errno);
+    }
+    fcntl(sh.pidfd, F_SETFD, FD_CLOEXEC);
+    return sh;
+}
+
+
+// Waits for a child that was told to end, so that it does not stay a
+// zombie. Deletes itself.
+struct child_reaper: io_handler {
+    child_reaper(io_service& ios, int pidfd) : ios(ios), pidfd(pidfd) {
+        ios.add(pidfd, EPOLLIN, this);
+    }
+
+    void handle_events(int) override {
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(static_cast<idtype_t>(P_PIDFD), pidfd, &info, WEXITED | WNOHANG) == 0 && info.si_pid == 0) {
+            return;
+        }
+        ios.remove(pidfd);
+        close(pidfd);
+        delete this;
+    }
+
+private:
+    io_service& ios;
+    int pidfd;
+};
+
+
+// Sends SIGINT to the shell through its pidfd, the shell also gets SIGHUP
+// once the caller closes the pty master. A child is reaped on the loop when
+// it exits, the helper reaps its own.
+inline void end_shell(io_service& ios, shell_process const& sh) {
+    syscall(SYS_pidfd_send_signal, sh.pidfd, SIGINT, nullptr, 0);
+    if (sh.is_child) {
+        new child_reaper(ios, sh.pidfd);
+    } else {
+        close(sh.pidfd);
+    }
+}
+
+
+// Warm pty+shell pairs kept by a helper process. The helper is forked at
+// startup, while the server is still small, so its forks stay cheap no
+// matter how many sessions the server holds. Every loop has its own
+// socketpair to the helper, registered with the loop: a request asks for one
+// more shell, the reply carries it (the pty master via SCM_RIGHTS) into the
+// loop's stock whenever it comes, the pty master and the shell's pidfd via
+// SCM_RIGHTS. A claim only takes from the stock and asks for a replacement,
+// it never waits for the helper. Must be created before any threads are
+// started.
+struct shell_pool {
+    shell_pool(size_t size, size_t clients) : helper(-1), stock_size((size + clients - 1) / clients) {
+        if (size == 0) {
+            return;
+        }
+        std::vector<int> helper_socks;
+        for (size_t i = 0; i < clients; ++i) {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, sv) == -1) {
+                perror("socketpair()");
+                exit(errno);
+            }
+            this->clients.emplace_back(new client(*this, sv[0]));
+            helper_socks.push_back(sv[1]);
+        }
+
+        helper = fork();
+        if (helper == -1) {
+            perror("fork()");
+            exit(errno);
+        } else if (helper == 0) {
+            for (auto& c : this->clients) {
+                close(c->sock);
+            }
+            serve(helper_socks, size);
+            _exit(0);
+        }
+        for (int sock : helper_socks) {
+            close(sock);
+        }
+    }
+
+    shell_pool(shell_pool const&) = delete;
+
+    ~shell_pool() {
+        for (auto& c : clients) {
+            c->close_all();
+        }
+    }
+
+    // Registers the client's socket with its loop and fills its stock.
+    void attach(size_t client, io_service& ios) {
+        if (helper == -1) {
+            return;
+        }
+        clients[client]->attach(ios);
+    }
+
+    // Takes a ready shell of the given client (loop), or spawns one in this
+    // process when the pool is disabled or the stock is empty.
+    shell_process claim(size_t client) {
+        shell_process sh;
+        if (helper == -1 || !clients[client]->claim(sh)) {
+            sh = spawn_shell();
+        }
+        return sh;
+    }
+
+private:
+    // One loop's end of the socketpair, used only by that loop's thread.
+    struct client : io_handler {
+        client(shell_pool& pool, int sock) : pool(pool), sock(sock), ios(nullptr), requested(0) {
+        }
+
+        void attach(io_service& ios) {
+            this->ios = &ios;
+            ios.add(sock, EPOLLIN, this);
+            refill();
+        }
+
+        bool claim(shell_process& sh) {
+            if (stock.empty()) {
+                refill();
+                return false;
+            }
+            sh = stock.back();
+            stock.pop_back();
+            refill();
+            return true;
+        }
+
+        void handle_events(int events) override {
+            if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                return;
+            }
+            shell_process sh;
+            int res;
+            while ((res = receive(sock, sh)) > 0) {
+                stock.push_back(sh);
+                if (requested != 0) {
+                    --requested;
+                }
+            }
+            if (res == 0) {
+                LOG_WARNING("shell pool helper is gone, spawning shells in the loop");
+                ios->remove(sock);
+                close(sock);
+                sock = -1;
+            }
+        }
+
+        // Asks for the shells missing from the stock. A request that does
+        // not fit into the socket is asked for again on the next claim.
+        void refill() {
+            char req = 0;
+            while (sock != -1 && stock.size() + requested < pool.stock_size
+                   && send(sock, &req, 1, MSG_NOSIGNAL) == 1) {
+                ++requested;
+            }
+        }
+
+        // Shells left in the stock get SIGHUP when their pty master closes.
+        void close_all() {
+            for (shell_process const& sh : stock) {
+                close(sh.ptymfd);
+                close(sh.pidfd);
+            }
+            stock.clear();
+            if (sock != -1) {
+                close(sock);
+            }
+        }
+
+        shell_pool& pool;
+        int sock;
+        io_service* ios;
+        size_t requested;
+        std::vector<shell_process> stock;
+    };
+
+    // The helper's loop: answers claims first, refills the pool when idle.
+    // Exits when all the loops are gone, shells left in the pool get SIGHUP.
+    // Exited shells are reaped through a signalfd, not by ignoring SIGCHLD,
+    // so that a pid stays taken until its pidfd is open.
+    static void serve(std::vector<int> const& socks, size_t size) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, nullptr);
+        int sig_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+        if (sig_fd == -1) {
+            perror("signalfd()");
+            exit(errno);
+        }
+
+        std::vector<shell_process> ready;
+        std::vector<pollfd> fds;
+        for (int sock : socks) {
+            fds.push_back({sock, POLLIN, 0});
+        }
+        size_t alive = fds.size();
+        fds.push_back({sig_fd, POLLIN, 0});
+        while (alive != 0) {
+            int res = poll(fds.data(), fds.size(), ready.size() < size ? 0 : -1);
+            if (res == -1 && errno != EINTR) {
+                perror("poll()");
+                break;
+            } else if (res <= 0) {
+                if (res == 0) {
+                    ready.push_back(spawn_shell());
+                }
+                continue;
+            }
+
+            for (pollfd& pfd : fds) {
+                if (pfd.revents == 0) {
+                    continue;
+                } else if (pfd.fd == sig_fd) {
+                    signalfd_siginfo info;
+                    while (read(sig_fd, &info, sizeof(info)) > 0) {
+                    }
+                    while (waitpid(-1, nullptr, WNOHANG) > 0) {
+                    }
+                    continue;
+                }
+                char req;
+                if (recv(pfd.fd, &req, 1, 0) <= 0) {
+                    close(pfd.fd);
+                    pfd.fd = -1;
+                    --alive;
+                    continue;
+                }
+                shell_process sh;
+                if (ready.empty()) {
+                    sh = spawn_shell();
+                } else {
+                    sh = ready.back();
+                    ready.pop_back();
+                }
+                reply(pfd.fd, sh);
+                close(sh.ptymfd);
+                close(sh.pidfd);
+            }
+        }
+
+        for (shell_process const& sh : ready) {
+            close(sh.ptymfd);
+            close(sh.pidfd);
+        }
+    }
+
+    // Returns 1 for a received shell, 0 when the helper is gone and -1 when
+    // there is nothing more to receive for now.
+    static int receive(int sock, shell_process& sh) {
+        int fds[2];
+        char control[CMSG_SPACE(sizeof(fds))];
+        iovec iov = {&sh.pid, sizeof(sh.pid)};
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t cnt;
+        while ((cnt = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+        }
+        if (cnt == -1) {
+            return errno == EAGAIN ? -1 : 0;
+        } else if (cnt == 0) {
+            return 0;
+        }
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cnt != sizeof(sh.pid) || cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS ||
+                cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+            return 0;
+        }
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        sh.ptymfd = fds[0];
+        sh.pidfd = fds[1];
+        sh.is_child = false;
+        return 1;
+    }
+
+    static void reply(int sock, shell_process const& sh) {
+        int fds[2] = {sh.ptymfd, sh.pidfd};
+        char control[CMSG_SPACE(sizeof(fds))];
+        memset(control, 0, sizeof(control));
+        iovec iov = {const_cast<pid_t*>(&sh.pid), sizeof(sh.pid)};
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+        if (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+            perror("sendmsg()");
+        }
+    }
+
+    pid_t helper;
+    size_t stock_size;
+    std::vector<std::unique_ptr<client>> clients;
+};
+
+#endif
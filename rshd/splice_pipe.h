@@ -0,0 +1,80 @@
+#ifndef SPLICE_PIPE_H
+#define SPLICE_PIPE_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "ring_buffer.h"
+
+
+// A pipe used as an in-kernel buffer between two fds: data is moved in and
+// out with splice() and never crosses user space.
+struct splice_pipe {
+    explicit splice_pipe(size_t capacity) : pending(0) {
+        if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            fds[0] = fds[1] = -1;
+            cap = 0;
+            return;
+        }
+        fcntl(fds[1], F_SETPIPE_SZ, static_cast<int>(capacity));
+        int res = fcntl(fds[1], F_GETPIPE_SZ);
+        cap = res == -1 ? 0 : res;
+    }
+
+    splice_pipe(splice_pipe const&) = delete;
+
+    ~splice_pipe() {
+        if (fds[0] != -1) {
+            close(fds[0]);
+            close(fds[1]);
+        }
+    }
+
+    bool is_valid() const {
+        return fds[0] != -1;
+    }
+
+    size_t size() const {
+        return pending;
+    }
+
+    size_t available() const {
+        return cap - pending;
+    }
+
+    // Same conventions as read(): bytes moved, 0 on EOF, -1 and errno.
+    ssize_t fill(int from) {
+        ssize_t cnt = splice(from, nullptr, fds[1], nullptr, available(), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (cnt > 0) {
+            pending += cnt;
+        }
+        return cnt;
+    }
+
+    ssize_t drain(int to) {
+        ssize_t cnt = splice(fds[0], nullptr, to, nullptr, pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (cnt > 0) {
+            pending -= cnt;
+        }
+        return cnt;
+    }
+
+    // Empties the pipe into a buffer, for when one of the fds turns out not
+    // to support splice().
+    void drain(ring_buffer& buf) {
+        while (pending != 0) {
+            buf.reserve(pending);
+            ssize_t cnt = buf.read_from(fds[0]);
+            if (cnt <= 0) {
+                break;
+            }
+            pending -= cnt;
+        }
+    }
+
+private:
+    int fds[2];
+    size_t cap, pending;
+};
+
+#endif
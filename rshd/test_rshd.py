@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+# Checks of raw and mux sessions against a fresh ./rshd (make it first), MCCP too
+# when the options include -z:
+#     python3 test_rshd.py [rshd binary [rshd options]]
+import os, socket, struct, subprocess, sys, time, zlib
+
+OPEN, OPEN_OK, DATA, WINDOW, CLOSE, EXEC, STDERR, EOF, EXIT = range(1, 10)
+RAW_PORT, MUX_PORT = 7410, 7411
+# MCCP v2 with -z: the offer, the answers and the start of compression
+WILL, DO, DONT, START = b'\xff\xfb\x56', b'\xff\xfd\x56', b'\xff\xfe\x56', b'\xff\xfa\x56\xff\xf0'
+
+
+class Mux:
+    def __init__(self, port=MUX_PORT, rcvbuf=None):
+        self.sock = socket.socket()
+        if rcvbuf is not None:
+            self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, rcvbuf)
+        self.sock.connect(('127.0.0.1', port))
+        self.buf = bytearray()
+
+    def send(self, channel, type, payload=b''):
+        self.sock.sendall(struct.pack('!IBI', channel, type, len(payload)) + payload)
+
+    def frame(self, timeout=10):
+        self.sock.settimeout(timeout)
+        while True:
+            if len(self.buf) >= 9:
+                channel, type, length = struct.unpack('!IBI', bytes(self.buf[:9]))
+                if len(self.buf) >= 9 + length:
+                    payload = bytes(self.buf[9:9 + length])
+                    del self.buf[:9 + length]
+                    return channel, type, payload
+            data = self.sock.recv(1 << 20)
+            if not data:
+                raise EOFError('connection closed')
+            self.buf += data
+
+    def close(self):
+        self.sock.close()
+
+
+def rss_kb(pid):
+    with open('/proc/%d/status' % pid) as f:
+        for line in f:
+            if line.startswith('VmRSS:'):
+                return int(line.split()[1])
+
+
+def cpu_seconds(pid):
+    with open('/proc/%d/stat' % pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+
+def check(name, ok, details=''):
+    print('%s: %s %s' % ('ok' if ok else 'FAILED', name, details))
+    return ok
+
+
+# A client that stops reading must not make the server queue the output of
+# its channels: the window is clamped and the channels wait for the socket,
+# without spinning on their fds meanwhile.
+def test_slow_reader(server, open_frame):
+    # Small socket buffers, so that the clamped window is not enough to
+    # stop the channel and the connection has to.
+    mux = Mux(rcvbuf=4096)
+    open_frame(mux)
+    before, cpu = rss_kb(server.pid), cpu_seconds(server.pid)
+    time.sleep(3)
+    after, cpu = rss_kb(server.pid), cpu_seconds(server.pid) - cpu
+    # Whatever it produced meanwhile still comes, and keeps coming
+    received = 0
+    while received < 16 << 20:
+        channel, type, payload = mux.frame()
+        if type in (DATA, STDERR):
+            received += len(payload)
+            mux.send(channel, WINDOW, struct.pack('!I', len(payload)))
+    mux.close()
+    return check('slow reader', after - before < 32 * 1024 and cpu < 0.5,
+                 'rss %d -> %d kB, %.2f s of cpu, then read %d MB' % (before, after, cpu, received >> 20))
+
+
+def open_yes_shell(mux):
+    mux.send(1, OPEN, struct.pack('!I', 0xf0000000))
+    mux.send(1, DATA, b'exec yes\n')
+
+
+def open_yes_command(mux):
+    mux.send(1, EXEC, struct.pack('!I', 0xf0000000) + b'yes; yes >&2')
+
+
+def run(mux, channel, command, stdin=None):
+    out, err, status = bytearray(), bytearray(), None
+    mux.send(channel, EXEC, struct.pack('!I', 1 << 20) + command)
+    if stdin is not None:
+        # Within the initial window, in frames of at most 16 kB
+        for i in range(0, len(stdin), 16384):
+            mux.send(channel, DATA, stdin[i:i + 16384])
+        mux.send(channel, EOF)
+    while True:
+        _, type, payload = mux.frame()
+        if type in (DATA, STDERR):
+            (out if type == DATA else err).extend(payload)
+            mux.send(channel, WINDOW, struct.pack('!I', len(payload)))
+        elif type == EXIT:
+            status = struct.unpack('!I', payload)[0]
+        elif type == CLOSE:
+            mux.send(channel, CLOSE)
+            return bytes(out), bytes(err), status
+
+
+def test_exec():
+    mux = Mux()
+    results = [
+        run(mux, 1, b'echo out; echo err >&2; exit 3') == (b'out\n', b'err\n', 3),
+        run(mux, 2, b'kill -9 $$')[2] == 137,
+        run(mux, 3, b'wc -c', b'x' * 100000)[0].strip() == b'100000',
+    ]
+    mux.close()
+    return check('exec', all(results), str(results))
+
+
+def raw_session(command):
+    sock = socket.create_connection(('127.0.0.1', RAW_PORT))
+    sock.sendall(command)
+    received = bytearray()
+    while True:
+        data = sock.recv(1 << 20)
+        if not data:
+            break
+        received += data
+    sock.close()
+    return bytes(received).removeprefix(WILL)
+
+
+# Everything the shell wrote before it exited reaches the client before the
+# connection closes.
+def test_raw_drain():
+    expected = b''.join(b'%d\n' % i for i in range(1, 200001))
+    failed = 0
+    for _ in range(5):
+        if raw_session(b'seq 1 200000; exit\n').replace(b'# ', b'') != expected:
+            failed += 1
+    return check('raw drain', failed == 0, '%d of 5 runs truncated' % failed)
+
+
+# A client that accepts the offer gets the rest of the output compressed,
+# one that refuses it gets it as is.
+def test_mccp():
+    expected = b''.join(b'%d\n' % i for i in range(1, 200001))
+    received = raw_session(DO + b'seq 1 200000; exit\n')
+    plain, start, compressed = received.partition(START)
+    out = plain + zlib.decompressobj().decompress(compressed)
+    results = [
+        start == START and out.replace(b'# ', b'') == expected,
+        raw_session(DONT + b'seq 1 200000; exit\n').replace(b'# ', b'') == expected,
+    ]
+    return check('mccp', all(results), '%s, %d bytes on the wire for %d' % (results, len(received), len(expected)))
+
+
+def main():
+    binary = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(os.path.abspath(__file__)), 'rshd')
+    server = subprocess.Popen([binary, '-t', '1', '-l', 'warning', '-m', str(MUX_PORT)] + sys.argv[2:] + [str(RAW_PORT)])
+    time.sleep(0.5)
+    try:
+        results = [
+            test_raw_drain(),
+            test_slow_reader(server, open_yes_shell),
+            test_exec(),
+            test_slow_reader(server, open_yes_command),
+        ]
+        if '-z' in sys.argv[2:]:
+            results.append(test_mccp())
+    finally:
+        server.terminate()
+        server.wait()
+    sys.exit(0 if all(results) else 1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,201 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <time.h>
+#include <algorithm>
+#include <functional>
+
+
+struct timer_wheel;
+
+// Intrusive timer, lives inside its owner and must stay in place (and be
+// cancelled before it is destroyed) while it is scheduled.
+struct timer {
+    typedef std::function<void()> timerfunc_t;
+
+    timer() = default;
+    explicit timer(timerfunc_t func) : callback(func) {};
+
+    timer(timer const&) = delete;
+    timer& operator=(timer const&) = delete;
+
+    bool is_active() const {
+        return pprev != nullptr;
+    }
+
+    uint64_t get_expires() const {
+        return expires;
+    }
+
+    timerfunc_t callback;
+
+private:
+    friend timer_wheel;
+
+    uint64_t expires = 0;
+    timer* next = nullptr;
+    timer** pprev = nullptr;
+    int level = 0, slot = 0;
+};
+
+
+// Hierarchical timing wheel with 1 ms ticks: four levels of 64 slots cover
+// 2^24 ms, later timers wait in the last level and are re-placed on cascade.
+// schedule() and cancel() are O(1), advance() cascades a higher level slot
+// once per 64 ticks of the level below and skips ticks with nothing to do.
+struct timer_wheel {
+    explicit timer_wheel(uint64_t now) : current(now), count(0) {
+        for (int level = 0; level < LEVELS; ++level) {
+            occupied[level] = 0;
+            for (int i = 0; i < SLOTS; ++i) {
+                slots[level][i] = nullptr;
+            }
+        }
+    }
+
+    timer_wheel(timer_wheel const&) = delete;
+
+    static uint64_t now_ms() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    void schedule(timer& t, uint64_t expires) {
+        if (t.is_active()) {
+            cancel(t);
+        }
+        t.expires = expires;
+        place(t);
+        ++count;
+    }
+
+    void cancel(timer& t) {
+        if (!t.is_active()) {
+            return;
+        }
+        unlink(t);
+        --count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    // Runs the callbacks of all timers that expired by now.
+    void advance(uint64_t now) {
+        while (current <= now) {
+            int idx = current & (SLOTS - 1);
+            if (idx == 0) {
+                for (int level = 1; level < LEVELS && cascade(level) == 0; ++level) {
+                }
+            }
+
+            while (slots[0][idx] != nullptr) {
+                timer* t = slots[0][idx];
+                unlink(*t);
+                --count;
+                t->callback();
+            }
+            ++current;
+
+            if (count == 0) {
+                current = now + 1;
+            } else {
+                current = std::min(next_tick(), now + 1);
+            }
+        }
+    }
+
+    // Milliseconds until advance() has something to do, -1 without timers.
+    int64_t next_timeout(uint64_t now) const {
+        if (count == 0) {
+            return -1;
+        }
+        uint64_t tick = next_tick();
+        return tick > now ? static_cast<int64_t>(tick - now) : 0;
+    }
+
+private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+
+    // The nearest tick at which advance() fires or cascades something, ticks
+    // in between only touch empty slots and are skipped.
+    uint64_t next_tick() const {
+        uint64_t res = UINT64_MAX;
+        for (int level = 0; level < LEVELS; ++level) {
+            if (occupied[level] == 0) {
+                continue;
+            }
+            int shift = level * SLOT_BITS;
+            uint64_t unit = 1ULL << shift;
+            // Slots of this level are processed at multiples of unit.
+            uint64_t start = (current + unit - 1) & ~(unit - 1);
+            int idx = (start >> shift) & (SLOTS - 1);
+            uint64_t rotated = idx == 0 ? occupied[level] : (occupied[level] >> idx) | (occupied[level] << (SLOTS - idx));
+            res = std::min(res, start + __builtin_ctzll(rotated) * unit);
+        }
+        return res;
+    }
+
+    // Moves the timers of the current slot of the level to the lower levels,
+    // returns the slot index so that the caller knows whether to go up.
+    int cascade(int level) {
+        int idx = (current >> (level * SLOT_BITS)) & (SLOTS - 1);
+        timer* t = slots[level][idx];
+        slots[level][idx] = nullptr;
+        occupied[level] &= ~(1ULL << idx);
+        while (t != nullptr) {
+            timer* next = t->next;
+            place(*t);
+            t = next;
+        }
+        return idx;
+    }
+
+    void place(timer& t) {
+        uint64_t expires = std::max(t.expires, current);
+        uint64_t delta = expires - current;
+        int level = 0;
+        while (level + 1 < LEVELS && delta >= (1ULL << ((level + 1) * SLOT_BITS))) {
+            ++level;
+        }
+        if (delta >= (1ULL << (LEVELS * SLOT_BITS))) {
+            expires = current + (1ULL << (LEVELS * SLOT_BITS)) - 1;
+        }
+
+        int idx = (expires >> (level * SLOT_BITS)) & (SLOTS - 1);
+        timer*& head = slots[level][idx];
+        t.level = level;
+        t.slot = idx;
+        t.next = head;
+        t.pprev = &head;
+        if (head != nullptr) {
+            head->pprev = &t.next;
+        }
+        head = &t;
+        occupied[level] |= 1ULL << idx;
+    }
+
+    void unlink(timer& t) {
+        *t.pprev = t.next;
+        if (t.next != nullptr) {
+            t.next->pprev = t.pprev;
+        }
+        t.next = nullptr;
+        t.pprev = nullptr;
+        if (slots[t.level][t.slot] == nullptr) {
+            occupied[t.level] &= ~(1ULL << t.slot);
+        }
+    }
+
+    uint64_t current;       // the next tick to process
+    size_t count;
+    uint64_t occupied[LEVELS];
+    timer* slots[LEVELS][SLOTS];
+};
+
+#endif
@@ -0,0 +1,366 @@
+#ifndef URING_BACKEND_H
+#define URING_BACKEND_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <memory>
+#include <vector>
+#include "io_backend.h"
+
+
+// Readiness through io_uring poll requests, with raw system calls (there is
+// no liburing here). connection still reads and writes by itself until
+// EAGAIN; what goes through the ring is the interest. Poll requests, their
+// removals and re-arms are queued as SQEs and submitted together with the
+// wait for completions: one io_uring_enter() per loop iteration instead of an
+// epoll_ctl() per change plus an epoll_wait().
+//
+// Level-triggered mode arms one-shot polls and re-arms them before the next
+// wait, after the event has been dispatched. If the fd is still ready then,
+// the new poll completes at once, which keeps the epoll level semantics.
+// Edge-triggered mode arms multishot polls, which the kernel runs as
+// edge-triggered, and re-arms one only when the kernel drops it.
+struct uring_backend: io_backend {
+    // Returns nullptr when the kernel has no io_uring or an old one.
+    static std::unique_ptr<io_backend> create(bool edge_triggered) {
+        std::unique_ptr<uring_backend> backend(new uring_backend(edge_triggered));
+        if (!backend->setup()) {
+            return nullptr;
+        }
+        return backend;
+    }
+
+    uring_backend(uring_backend const&) = delete;
+
+    ~uring_backend() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (rings != MAP_FAILED) {
+            munmap(rings, rings_size);
+        }
+        if (ring_fd != -1) {
+            close(ring_fd);
+        }
+    }
+
+    void add(int fd, int events, io_handler* handler) override {
+        if (static_cast<size_t>(fd) >= slots.size()) {
+            slots.resize(fd + 1);
+        }
+        slot& s = slots[fd];
+        s.handler = handler;
+        s.events = events;
+        s.armed = false;
+        ++s.gen;
+        mark_dirty(fd);
+    }
+
+    void change(int fd, int events, io_handler*) override {
+        slot& s = slots[fd];
+        if (s.events == events) {
+            return;
+        }
+        s.events = events;
+        if (s.armed) {
+            // A completion of the old poll may be in the ring already, the
+            // new generation drops it. The new poll reports the fd anew.
+            queue_poll_remove(fd);
+            s.armed = false;
+            ++s.gen;
+        }
+        mark_dirty(fd);
+    }
+
+    void remove(int fd) override {
+        slot& s = slots[fd];
+        if (s.armed) {
+            queue_poll_remove(fd);
+        }
+        s.handler = nullptr;
+        s.armed = false;
+        ++s.gen;
+    }
+
+    int wait(epoll_event* events, int max_events, int timeout_ms) override {
+        if (!ring_registered) {
+            register_ring();
+        }
+        for (int fd: dirty) {
+            slot& s = slots[fd];
+            s.dirty = false;
+            if (s.handler != nullptr && !s.armed) {
+                queue_poll_add(fd);
+            }
+        }
+        dirty.clear();
+
+        if (__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) == *cq_head) {
+            __kernel_timespec ts;
+            io_uring_getevents_arg arg;
+            memset(&arg, 0, sizeof(arg));
+            if (timeout_ms != -1) {
+                ts.tv_sec = timeout_ms / 1000;
+                ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+                arg.ts = reinterpret_cast<uint64_t>(&ts);
+            }
+            if (enter(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) == -1 &&
+                    errno != ETIME) {
+                return -1;
+            }
+        } else if (to_submit() != 0) {
+            enter(0, 0, nullptr, 0);
+        }
+
+        int num = 0;
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail && num < max_events; ++head) {
+            io_uring_cqe const& cqe = cqes[head & *cq_mask];
+            int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+            if (cqe.user_data == REMOVE_TAG || static_cast<size_t>(fd) >= slots.size()) {
+                continue;
+            }
+            slot& s = slots[fd];
+            if (s.handler == nullptr || s.gen != static_cast<uint32_t>(cqe.user_data >> 32)) {
+                continue;
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                s.armed = false;
+                mark_dirty(fd);
+            }
+            int ready = cqe.res < 0 ? EPOLLERR : cqe.res;
+            if (ready != 0) {
+                events[num].events = ready;
+                events[num].data.ptr = s.handler;
+                ++num;
+            }
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        return num;
+    }
+
+    const char* name() const override {
+        return "io_uring";
+    }
+
+private:
+    static const unsigned ENTRIES = 1024;
+    static const uint64_t REMOVE_TAG = ~0ULL;
+    static const uint64_t PROBE_TAG = ~0ULL - 1;
+
+    // The interest in one fd. Completions carry the fd and the generation in
+    // user_data, the ones of polls removed or replaced since are ignored.
+    struct slot {
+        io_handler* handler = nullptr;
+        int events = 0;
+        uint32_t gen = 0;
+        bool armed = false;
+        bool dirty = false;
+    };
+
+    explicit uring_backend(bool edge_triggered) : edge_triggered(edge_triggered) {}
+
+    bool setup() {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+#ifdef IORING_SETUP_COOP_TASKRUN
+        // Completions are only looked at in wait() anyway, no need to
+        // interrupt the loop for them.
+        params.flags = IORING_SETUP_COOP_TASKRUN;
+#endif
+        ring_fd = syscall(__NR_io_uring_setup, ENTRIES, &params);
+        if (ring_fd == -1 && errno == EINVAL && params.flags != 0) {
+            memset(&params, 0, sizeof(params));
+            ring_fd = syscall(__NR_io_uring_setup, ENTRIES, &params);
+        }
+        if (ring_fd == -1) {
+            LOG_WARNING("io_uring_setup() error %d", errno);
+            return false;
+        }
+        unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+        if ((params.features & required) != required) {
+            LOG_WARNING("io_uring lacks features, has %x", params.features);
+            return false;
+        }
+        enter_fd = ring_fd;
+
+        rings_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                              params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        rings = mmap(nullptr, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                     IORING_OFF_SQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                    IORING_OFF_SQES);
+        if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+            LOG_WARNING("mmap() of io_uring error %d", errno);
+            return false;
+        }
+
+        char* base = static_cast<char*>(rings);
+        sq_head = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        sq_array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+        sq_local_tail = *sq_tail;
+        return probe();
+    }
+
+    // IORING_REGISTER_PROBE lists the supported opcodes. Whether POLL_ADD
+    // takes IORING_POLL_ADD_MULTI (5.13) only shows by trying it, older
+    // kernels fail the request with -EINVAL.
+    bool probe() {
+        size_t size = sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op);
+        std::unique_ptr<char[]> buf(new char[size]());
+        io_uring_probe* ops = reinterpret_cast<io_uring_probe*>(buf.get());
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, ops, IORING_OP_LAST) == -1) {
+            LOG_WARNING("io_uring probe error %d", errno);
+            return false;
+        }
+        for (int op: {IORING_OP_POLL_ADD, IORING_OP_POLL_REMOVE}) {
+            if (op > ops->last_op || !(ops->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                LOG_WARNING("io_uring lacks opcode %d", op);
+                return false;
+            }
+        }
+        if (edge_triggered && !try_multishot_poll()) {
+            LOG_WARNING("io_uring lacks multishot polls");
+            return false;
+        }
+        return true;
+    }
+
+    // Polls a readable pipe: a multishot poll reports it with more to come.
+    // Completions left behind carry PROBE_TAG, which wait() ignores.
+    bool try_multishot_poll() {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            return false;
+        }
+        bool multishot = false;
+        if (::write(fds[1], "", 1) == 1) {
+            io_uring_sqe* sqe = get_sqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fds[0];
+            sqe->poll32_events = EPOLLIN;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            sqe->user_data = PROBE_TAG;
+            if (enter(1, IORING_ENTER_GETEVENTS, nullptr, 0) != -1) {
+                unsigned head = *cq_head;
+                if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                    io_uring_cqe const& cqe = cqes[head & *cq_mask];
+                    multishot = cqe.res > 0 && (cqe.flags & IORING_CQE_F_MORE);
+                    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                }
+            }
+            if (multishot) {
+                sqe = get_sqe();
+                sqe->opcode = IORING_OP_POLL_REMOVE;
+                sqe->fd = -1;
+                sqe->addr = PROBE_TAG;
+                sqe->user_data = REMOVE_TAG;
+                enter(0, 0, nullptr, 0);
+            }
+        }
+        close(fds[0]);
+        close(fds[1]);
+        calls = 0;
+        return multishot;
+    }
+
+    // A registered ring fd saves the fd lookup on every io_uring_enter(). The
+    // registration belongs to the calling thread, so it is done by the thread
+    // that runs the loop.
+    void register_ring() {
+        ring_registered = true;
+#ifdef IORING_REGISTER_RING_FDS
+        io_uring_rsrc_update update;
+        memset(&update, 0, sizeof(update));
+        update.offset = -1U;
+        update.data = ring_fd;
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_RING_FDS, &update, 1) == 1) {
+            enter_fd = update.offset;
+            enter_flags = IORING_ENTER_REGISTERED_RING;
+        }
+#endif
+    }
+
+    unsigned to_submit() const {
+        return sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    int enter(unsigned min_complete, unsigned flags, void* arg, size_t arg_size) {
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        ++calls;
+        return syscall(__NR_io_uring_enter, enter_fd, to_submit(), min_complete, flags | enter_flags,
+                       arg, arg_size);
+    }
+
+    io_uring_sqe* get_sqe() {
+        if (to_submit() == sq_entries) {
+            // Only when interest changes outrun the loop by a full ring
+            enter(0, 0, nullptr, 0);
+        }
+        unsigned index = sq_local_tail & sq_mask;
+        sq_array[index] = index;
+        ++sq_local_tail;
+        io_uring_sqe* sqe = &static_cast<io_uring_sqe*>(sqes)[index];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    uint64_t tag(int fd) const {
+        return static_cast<uint64_t>(slots[fd].gen) << 32 | static_cast<uint32_t>(fd);
+    }
+
+    void queue_poll_add(int fd) {
+        slot& s = slots[fd];
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = s.events | EPOLLERR | EPOLLHUP;
+        sqe->len = edge_triggered ? IORING_POLL_ADD_MULTI : 0;
+        sqe->user_data = tag(fd);
+        s.armed = true;
+    }
+
+    void queue_poll_remove(int fd) {
+        io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = tag(fd);
+        sqe->user_data = REMOVE_TAG;
+    }
+
+    void mark_dirty(int fd) {
+        if (!slots[fd].dirty) {
+            slots[fd].dirty = true;
+            dirty.push_back(fd);
+        }
+    }
+
+    bool edge_triggered;
+    int ring_fd = -1, enter_fd = -1;
+    unsigned enter_flags = 0;
+    bool ring_registered = false;
+    void* rings = MAP_FAILED;
+    void* sqes = MAP_FAILED;
+    size_t rings_size = 0, sqes_size = 0;
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned sq_mask, sq_entries, sq_local_tail;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe* cqes;
+    std::vector<slot> slots;    // indexed by fd
+    std::vector<int> dirty;     // fds to be re-armed before the next wait
+};
+
+#endif
@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+# Benchmarks of ./simplesh (make it first):
+#     python3 bench.py latency|script|parse|pipe [simplesh binary]
+# parse runs ./bench_parse next to the binary instead: make bench_parse
+import os, random, re, subprocess, sys, tempfile, time
+
+PROMPT = b'$ \0'
+
+
+# Time from sending a line to the next prompt, with the shell reading a pipe
+# as it would a terminal. /bin/true is a process to spawn and reap, true is
+# the builtin.
+def latency(binary):
+    shell = subprocess.Popen([binary], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    out = shell.stdout.raw
+
+    def wait_prompt():
+        received = b''
+        while not received.endswith(PROMPT):
+            data = out.read(1 << 16)
+            if not data:
+                sys.exit('simplesh exited')
+            received += data
+
+    wait_prompt()
+    for command in (b'/bin/true', b'true', b'/bin/true | /bin/true | /bin/true'):
+        times = []
+        for _ in range(500):
+            start = time.perf_counter()
+            shell.stdin.write(command + b'\n')
+            shell.stdin.flush()
+            wait_prompt()
+            times.append(time.perf_counter() - start)
+        times.sort()
+        print('%-34s median %7.3f ms, p90 %7.3f ms, max %7.3f ms'
+              % (command.decode(), times[len(times) // 2] * 1e3, times[len(times) * 9 // 10] * 1e3,
+                 times[-1] * 1e3))
+    shell.stdin.close()
+    shell.wait()
+
+
+# Commands/sec for a 100k-line script given as an argument, as stdin (a
+# regular file) and piped in. Builtin lines show the reading and parsing,
+# spawned ones the launch, background ones the job table.
+def script(binary):
+    lines = 100000
+    for command in (b'true', b'/bin/true', b'/bin/true &'):
+        with tempfile.NamedTemporaryFile() as f:
+            f.write((command + b'\n') * lines)
+            f.flush()
+            for mode in ('argument', 'stdin', 'pipe'):
+                start = time.perf_counter()
+                if mode == 'argument':
+                    subprocess.run([binary, f.name], stdout=subprocess.DEVNULL, check=True)
+                elif mode == 'stdin':
+                    with open(f.name, 'rb') as stdin:
+                        subprocess.run([binary], stdin=stdin, stdout=subprocess.DEVNULL, check=True)
+                else:
+                    cat = subprocess.Popen(['cat', f.name], stdout=subprocess.PIPE)
+                    subprocess.run([binary], stdin=cat.stdout, stdout=subprocess.DEVNULL, check=True)
+                    cat.stdout.close()
+                    cat.wait()
+                elapsed = time.perf_counter() - start
+                print('%-12s %-8s %d lines in %6.2f s, %8.0f commands/s'
+                      % (command.decode(), mode, lines, elapsed, lines / elapsed))
+
+
+# Lines/s and MB/s of the in-place parser over a 200k-line script of
+# pipelines with quoting and redirections, against the old parser on the
+# same lines (which takes the quotes and operators for plain words).
+def parse(binary):
+    lines, passes = 200000, 10
+    programs = ['grep', 'sort', 'uniq', 'head', 'wc', 'cut', 'tr']
+    options = ['-v', '-n', '-c', '-20', '-l', '-d:', '-f1', 'a-z']
+    quoted = ["'a b c'", '"$HOME/x y"', '"say \\"hi\\""', "it\\'s", "'|'", '"<>"']
+    rnd = random.Random(1)
+    with tempfile.NamedTemporaryFile('w') as f:
+        for _ in range(lines):
+            stages = []
+            for _ in range(rnd.randint(1, 4)):
+                stage = [rnd.choice(programs)] + [rnd.choice(options) for _ in range(rnd.randint(0, 3))]
+                if rnd.random() < 0.5:
+                    stage.insert(rnd.randint(1, len(stage)), rnd.choice(quoted))
+                stages.append(' '.join(stage))
+            if rnd.random() < 0.3:
+                stages[0] += ' < in.txt'
+            if rnd.random() < 0.3:
+                stages[-1] += rnd.choice([' > out.txt', ' >> log.txt'])
+            f.write(' | '.join(stages) + (' &' if rnd.random() < 0.1 else '') + '\n')
+        f.flush()
+        size = os.path.getsize(f.name)
+        driver = os.path.join(os.path.dirname(os.path.abspath(binary)), 'bench_parse')
+        out = subprocess.run([driver, f.name, str(passes)], stdout=subprocess.PIPE, check=True).stdout.decode()
+    print('%d lines, %.1f MB, %d passes' % (lines, size / 1e6, passes))
+    for result in out.splitlines():
+        name, seconds, commands = result.split()
+        seconds = float(seconds)
+        print('%-9s %6.3f s, %6.2f M lines/s, %7.1f MB/s, %d commands'
+              % (name, seconds, lines * passes / seconds / 1e6, size * passes / seconds / 1e6, int(commands)))
+
+
+# MB/s of 2 GB of zeroes through cat | wc -c. "stdin" gives the shell the
+# line with the data right behind it, which the command reads from the
+# spliced global pipe; "in a line" pipes them from head in the command line;
+# "sh" is the same line run by /bin/sh. wc must count every byte.
+def pipe(binary):
+    size = 2 << 30
+    for name, command, stdin in (
+            ('stdin', [binary], "printf 'cat | wc -c\\n'; head -c %d /dev/zero" % size),
+            ('in a line', [binary], "printf 'head -c %d /dev/zero | cat | wc -c\\n'" % size),
+            ('sh', ['/bin/sh'], "printf 'head -c %d /dev/zero | cat | wc -c\\n'" % size)):
+        rates = []
+        for _ in range(3):
+            feed = subprocess.Popen(stdin, shell=True, stdout=subprocess.PIPE)
+            start = time.perf_counter()
+            out = subprocess.run(command, stdin=feed.stdout, stdout=subprocess.PIPE, check=True).stdout
+            elapsed = time.perf_counter() - start
+            feed.stdout.close()
+            feed.wait()
+            counted = [int(n) for n in re.findall(rb'\d+', out)]
+            if counted != [size]:
+                sys.exit('%s: wc counted %s bytes, not %d' % (name, counted, size))
+            rates.append(size / elapsed / 1e6)
+        print('%-10s %d MB in %.2f s, %6.0f MB/s' % (name, size >> 20, size / max(rates) / 1e6, max(rates)))
+
+
+BENCHMARKS = {
+    'latency': latency,
+    'script': script,
+    'parse': parse,
+    'pipe': pipe,
+}
+
+
+def main():
+    if len(sys.argv) < 2 or sys.argv[1] not in BENCHMARKS:
+        sys.exit('Usage: bench.py %s [simplesh binary]' % '|'.join(BENCHMARKS))
+    binary = sys.argv[2] if len(sys.argv) > 2 else os.path.join(os.path.dirname(os.path.abspath(__file__)), 'simplesh')
+    BENCHMARKS[sys.argv[1]](binary)
+
+
+if __name__ == '__main__':
+    main()
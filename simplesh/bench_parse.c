@@ -0,0 +1,129 @@
+// Times command_parser (parser.h) over every line of a script against the
+// parse_buffer() it replaced, which split on spaces and | only:
+//     make bench_parse && ./bench_parse script [passes]
+// Both get each line copied into a fresh buffer first, as simplesh does.
+// Prints "<parser> <seconds> <commands>" per parser, bench.py parse turns
+// that into lines/s and MB/s.
+#include <chrono>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "parser.h"
+
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+// The removed parser, with the delete[] loop that followed every command.
+static char* create_from_string(std::string const& str) {
+    char* res = new char[str.size() + 1];
+    memcpy(res, str.data(), str.size());
+    res[str.size()] = 0;
+    return res;
+}
+
+static bool parse_buffer(std::string const& input_buffer, std::vector<std::vector<char*>> &out) {
+    auto it = input_buffer.begin();
+    std::string arg;
+    std::vector<char*> args;
+
+    while(*it != '\n') {
+        if(*it == ' ') {
+            if(!arg.empty()) {
+                args.push_back(create_from_string(arg));
+                arg.clear();
+            }
+        } else if (*it == '|') {
+            if(!arg.empty()) {
+                args.push_back(create_from_string(arg));
+                arg.clear();
+            }
+
+            if(args.empty()) {
+                return false;
+            }
+
+            args.push_back(0);
+            out.push_back(args);
+            args.clear();
+            arg.clear();
+        } else {
+            arg += *it;
+        }
+        ++it;
+    }
+
+    if(!arg.empty()) {
+        args.push_back(create_from_string(arg));
+    }
+
+    if(!args.empty()) {
+        args.push_back(0);
+        out.push_back(args);
+    }
+
+    return !args.empty();
+}
+
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s script [passes]\n", argv[0]);
+        return EINVAL;
+    }
+    int passes = argc > 2 ? atoi(argv[2]) : 10;
+    FILE* f = fopen(argv[1], "r");
+    if (f == nullptr) {
+        perror(argv[1]);
+        return errno;
+    }
+    std::vector<std::string> lines;
+    char* line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, f)) != -1) {
+        lines.emplace_back(line, len);
+    }
+    free(line);
+    fclose(f);
+
+    std::vector<char> buf;
+    command_parser parser;
+    size_t commands = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; ++pass) {
+        for (std::string const& str: lines) {
+            buf.assign(str.begin(), str.end());
+            buf.push_back(0);
+            if (!parser.parse(buf.data())) {
+                fprintf(stderr, "%s: %s", parser.error, str.c_str());
+                return EINVAL;
+            }
+            commands += parser.commands().size();
+        }
+    }
+    printf("in-place %f %zu\n", seconds_since(start), commands);
+
+    std::vector<std::vector<char*>> parsed_data;
+    commands = 0;
+    start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; ++pass) {
+        for (std::string const& str: lines) {
+            std::string input_buffer(str);
+            parse_buffer(input_buffer, parsed_data);
+            commands += parsed_data.size();
+            for (auto& args: parsed_data) {
+                for (char* arg: args) {
+                    delete[] arg;
+                }
+            }
+            parsed_data.clear();
+        }
+    }
+    printf("old %f %zu\n", seconds_since(start), commands);
+    return 0;
+}
@@ -0,0 +1,152 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <string.h>
+#include <vector>
+
+
+struct command {
+    char** argv;            // null-terminated
+    const char* in_file;    // < file
+    const char* out_file;   // > file or >> file
+    bool is_append;
+};
+
+
+// Splits a command line into a pipeline of commands. Tokens are unquoted and
+// null-terminated in place, inside the line itself, and all argv arrays are
+// kept back to back in one vector: once the vectors have grown, parsing a
+// line allocates nothing. Supports '...', "..." and \ quoting, |, <, > and >>
+// and a trailing & for lines to be run in background.
+struct command_parser {
+    // The line must be null-terminated and outlive the commands. Returns
+    // false on a syntax error, a blank line gives no commands.
+    bool parse(char* line) {
+        cmds.clear();
+        args.clear();
+        error = nullptr;
+        is_background = false;
+        // Every argument and every | take at least one char of the line, so
+        // the argv pointers below are never invalidated by a reallocation.
+        args.reserve(strlen(line) + 2);
+
+        command cur = {nullptr, nullptr, nullptr, false};
+        size_t argv_start = 0;
+        char* pos = line;
+        char c = *pos;
+        while (true) {
+            while (is_blank(c)) {
+                c = *++pos;
+            }
+
+            if (c == 0 || c == '|') {
+                if (args.size() == argv_start) {
+                    if (c == 0 && cmds.empty() && cur.in_file == nullptr && cur.out_file == nullptr &&
+                            !is_background) {
+                        return true;
+                    }
+                    error = "empty command";
+                    return false;
+                }
+                args.push_back(nullptr);
+                cur.argv = &args[argv_start];
+                cmds.push_back(cur);
+                if (c == 0) {
+                    return true;
+                }
+                cur = {nullptr, nullptr, nullptr, false};
+                argv_start = args.size();
+                c = *++pos;
+            } else if (c == '&') {
+                c = *++pos;
+                while (is_blank(c)) {
+                    c = *++pos;
+                }
+                if (c != 0) {
+                    error = "& must end the line";
+                    return false;
+                }
+                is_background = true;
+            } else if (c == '<' || c == '>') {
+                bool is_input = c == '<';
+                c = *++pos;
+                if (!is_input && c == '>') {
+                    cur.is_append = true;
+                    c = *++pos;
+                }
+                while (is_blank(c)) {
+                    c = *++pos;
+                }
+                if (c == 0 || is_operator(c)) {
+                    error = "missing file name";
+                    return false;
+                }
+                char* file = read_word(pos, c);
+                if (file == nullptr) {
+                    return false;
+                }
+                (is_input ? cur.in_file : cur.out_file) = file;
+            } else {
+                char* word = read_word(pos, c);
+                if (word == nullptr) {
+                    return false;
+                }
+                args.push_back(word);
+            }
+        }
+    }
+
+    std::vector<command> const& commands() const {
+        return cmds;
+    }
+
+    const char* error;
+    bool is_background;
+
+private:
+    static bool is_blank(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    static bool is_operator(char c) {
+        return c == '|' || c == '<' || c == '>' || c == '&';
+    }
+
+    // Unquotes the word starting at pos into the same place and terminates
+    // it. pos is left at the char after the word, which may have been
+    // overwritten by the terminator, so it is returned in c.
+    char* read_word(char*& pos, char& c) {
+        char* word = pos;
+        char* out = pos;
+        while (c != 0 && !is_blank(c) && !is_operator(c)) {
+            if (c == '\'' || c == '"') {
+                char quote = c;
+                ++pos;
+                while (*pos != quote) {
+                    if (*pos == 0) {
+                        error = "unterminated quote";
+                        return nullptr;
+                    }
+                    if (quote == '"' && *pos == '\\' && pos[1] != 0 && strchr("\"\\$`", pos[1]) != nullptr) {
+                        ++pos;
+                    }
+                    *out++ = *pos++;
+                }
+                ++pos;
+            } else if (c == '\\' && pos[1] != 0) {
+                ++pos;
+                *out++ = *pos++;
+            } else {
+                *out++ = *pos++;
+            }
+            c = *pos;
+        }
+        *out = 0;
+        return word;
+    }
+
+    std::vector<command> cmds;
+    std::vector<char*> args;
+};
+
+#endif
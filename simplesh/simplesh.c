@@ -6,10 +6,16 @@
 #include <string.h>
 #include <sys/wait.h>
 #include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <algorithm>
 #include <vector>
 #include <list>
+#include <unordered_map>
+#include "launch.h"
+#include "parser.h"
 
 
 #define MAX_EVENTS 1000
@@ -17,102 +23,230 @@
 const char PROMPT[] = "$ ";
 const char NEWLINE = '\n';
 const size_t BUFFER_SIZE = 1024;
+// Lines are looked for in that much of the input head, longer ones are
+// taken out of the pipe piece by piece
+const size_t MAX_LINE = 64 * 1024;
+const int PIPE_SIZE = 1024 * 1024;
+const char USAGE[] = "Usage: simplesh [-j max_jobs] [script]\n";
 
 
 void stdin_available(int event);
 void print_prompt();
 void safe_write(int fd, const char* buf, size_t size);
-void load_command();
-void put_stdin_to_pipe();
+bool load_command();
+void forward_stdin();
+void finish_command();
+
+// Background jobs, launched_pids are the foreground ones
+struct job {
+    int id;
+    std::vector<pid_t> pids;
+    std::string line;
+};
 
 std::list<int> launched_pids;
-std::vector<std::vector<char*>> parsed_data;
+std::list<job> jobs;
+command_parser parser;
+bool is_parsed_ahead = false, is_parsed_ok;
+size_t max_jobs = 64;
 bool is_terminating, is_stdin_eof = false;
-int epoll_fd;
+int epoll_fd, sig_fd;
 std::string input_buffer;
-int global_pipe[2];
-
+// All the input not consumed yet, commands are taken from its head and the
+// first process of a pipeline reads the rest. peek_pipe gets copies of the
+// head, so that looking for a command line does not consume anything.
+int global_pipe[2], peek_pipe[2];
+// The head of a line longer than MAX_LINE, already read from global_pipe
+std::string long_line;
+int null_fd;
+// Script mode: the script is mapped, lines are taken straight from memory
+// and the next one is parsed while the current one runs. There are no
+// prompts and the commands get the shell's stdin.
+const char* script = nullptr;
+size_t script_size = 0, script_pos = 0;
+// Where the commands were found in PATH, cleared when it may change.
+std::unordered_map<std::string, std::string> path_cache;
+
+
+// Returns nullptr when file is not found, then spawn() reports the error.
+const char* find_in_path(const char* file) {
+    if (strchr(file, '/') != nullptr) {
+        return file;
+    }
+    auto it = path_cache.find(file);
+    if (it != path_cache.end()) {
+        return it->second.c_str();
+    }
 
-char* create_from_string(std::string const& str) {
-    char* res = new char[str.size() + 1];
-    memcpy(res, str.data(), str.size());
-    res[str.size()] = 0;
-    return res;
+    const char* path = getenv("PATH");
+    if (path == nullptr) {
+        path = "/bin:/usr/bin";
+    }
+    std::string candidate;
+    for (const char* dir = path; ; ) {
+        const char* end = strchrnul(dir, ':');
+        candidate.assign(dir, end - dir);
+        candidate += candidate.empty() ? "./" : "/";
+        candidate += file;
+        struct stat st;
+        if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(candidate.c_str(), X_OK) == 0) {
+            return path_cache.emplace(file, candidate).first->second.c_str();
+        }
+        if (*end == 0) {
+            return nullptr;
+        }
+        dir = end + 1;
+    }
 }
 
 
-bool parse_buffer(std::string const& input_buffer, std::vector<std::vector<char*>> &out) {
-    auto it = input_buffer.begin();
-    std::string arg;
-    std::vector<char*> args;
+// All the pipes are close-on-exec, the child only keeps its standard fds.
+void create_process(const char* file, char* const* argv, int in_fd=STDIN_FILENO, int out_fd=STDOUT_FILENO) {
+    // printf("proc %s will read from %d and write to %d\n", file, in_fd, out_fd);
+    spawn_actions actions;
+    actions.redirect(in_fd, STDIN_FILENO).redirect(out_fd, STDOUT_FILENO);
+    const char* path = find_in_path(file);
+    pid_t child_pid = path != nullptr ? actions.spawn_path(path, argv) : actions.spawn(file, argv);
+    if (child_pid == -1 && path != nullptr && path != file && errno == ENOENT) {
+        // The command is gone from where it was found
+        path_cache.erase(file);
+        child_pid = actions.spawn(file, argv);
+    }
+    if (child_pid == -1) {
+        perror("posix_spawnp()");
+    } else {
+        launched_pids.push_back(child_pid);
+    }
+}
 
-    while(*it != '\n') {
-        if(*it == ' ') {
-            if(!arg.empty()) {
-                args.push_back(create_from_string(arg));
-                arg.clear();
-            }
-        } else if (*it == '|') {
-            if(!arg.empty()) {
-                args.push_back(create_from_string(arg));
-                arg.clear();
-            }
 
-            if(args.empty()) {
-                return false;
+// Redirections take the place of the pipeline fds.
+void launch_command(command const& cmd, int in_fd, int out_fd) {
+    int in_file = -1, out_file = -1;
+    if (cmd.in_file != nullptr && (in_file = open(cmd.in_file, O_RDONLY | O_CLOEXEC)) == -1) {
+        perror(cmd.in_file);
+        return;
+    }
+    if (cmd.out_file != nullptr) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (cmd.is_append ? O_APPEND : O_TRUNC);
+        if ((out_file = open(cmd.out_file, flags, 0644)) == -1) {
+            perror(cmd.out_file);
+            if (in_file != -1) {
+                close(in_file);
             }
-
-            args.push_back(0);
-            out.push_back(args);
-            args.clear();
-            arg.clear();
-        } else {
-            arg += *it;
+            return;
         }
-        ++it;
     }
 
-    if(!arg.empty()) {
-        args.push_back(create_from_string(arg));
-    }
+    create_process(cmd.argv[0], cmd.argv, in_file != -1 ? in_file : in_fd, out_file != -1 ? out_file : out_fd);
 
-    if(!args.empty()) {
-        args.push_back(0);
-        out.push_back(args);
+    if (in_file != -1) {
+        close(in_file);
+    }
+    if (out_file != -1) {
+        close(out_file);
     }
+}
 
-    return !args.empty();
+
+void builtin_cd(char* const* argv, int out_fd) {
+    const char* dir = argv[1] != nullptr ? argv[1] : getenv("HOME");
+    if (dir == nullptr || chdir(dir) == -1) {
+        perror("cd");
+        return;
+    }
+    // Relative PATH entries now point elsewhere
+    path_cache.clear();
 }
 
 
-void create_process(const char* file, char* const* argv, int in_fd=STDIN_FILENO, int out_fd=STDOUT_FILENO, int close_in_child=-1) {
-    // printf("proc %s will read from %d and write to %d\n", file, in_fd, out_fd);
-    int child_pid = fork();
-    if (child_pid == -1) {
-        perror("fork()");
-        exit(errno);
-    } else if (child_pid == 0) {
-        if (close_in_child != -1) {
-            close(close_in_child);
+void builtin_echo(char* const* argv, int out_fd) {
+    static std::string output;
+    bool is_newline = true;
+    ++argv;
+    if (*argv != nullptr && strcmp(*argv, "-n") == 0) {
+        is_newline = false;
+        ++argv;
+    }
+    output.clear();
+    for (; *argv != nullptr; ++argv) {
+        output += *argv;
+        if (argv[1] != nullptr) {
+            output += ' ';
         }
+    }
+    if (is_newline) {
+        output += NEWLINE;
+    }
+    safe_write(out_fd, output.data(), output.size());
+}
 
-        if (in_fd != STDIN_FILENO) {
-            dup2(in_fd, STDIN_FILENO);
-            close(in_fd);
+
+void builtin_true(char* const* argv, int out_fd) {
+}
+
+
+void builtin_exit(char* const* argv, int out_fd) {
+    exit(argv[1] != nullptr ? atoi(argv[1]) : 0);
+}
+
+
+// Every variable is exported already, only assignments change anything.
+void builtin_export(char* const* argv, int out_fd) {
+    for (++argv; *argv != nullptr; ++argv) {
+        char* value = strchr(*argv, '=');
+        if (value == nullptr) {
+            continue;
+        }
+        std::string name(*argv, value - *argv);
+        setenv(name.c_str(), value + 1, 1);
+        if (name == "PATH") {
+            path_cache.clear();
         }
+    }
+}
+
+
+struct builtin {
+    const char* name;
+    void (*func)(char* const* argv, int out_fd);
+};
+
+const builtin BUILTINS[] = {
+    {"cd", builtin_cd},
+    {"echo", builtin_echo},
+    {"true", builtin_true},
+    {"exit", builtin_exit},
+    {"export", builtin_export},
+};
+
 
-        if (out_fd != STDOUT_FILENO) {
-            dup2(out_fd, STDOUT_FILENO);
-            close(out_fd);
+// Builtins run in the shell itself, but only as single foreground commands:
+// in pipelines and in background they are started as external commands.
+bool run_builtin(command const& cmd) {
+    const builtin* found = nullptr;
+    for (builtin const& b : BUILTINS) {
+        if (strcmp(cmd.argv[0], b.name) == 0) {
+            found = &b;
         }
+    }
+    if (found == nullptr) {
+        return false;
+    }
 
-        if(execvp(file, argv) == -1) {
-            perror("execvp()");
-            exit(errno);
+    int out_fd = STDOUT_FILENO;
+    if (cmd.out_file != nullptr) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (cmd.is_append ? O_APPEND : O_TRUNC);
+        if ((out_fd = open(cmd.out_file, flags, 0644)) == -1) {
+            perror(cmd.out_file);
+            return true;
         }
-    } else {
-        launched_pids.push_back(child_pid);
     }
+    found->func(cmd.argv, out_fd);
+    if (out_fd != STDOUT_FILENO) {
+        close(out_fd);
+    }
+    return true;
 }
 
 
@@ -129,7 +263,9 @@ void sig_handler(int signo, siginfo_t* siginfo, void* ucontext) {
 
 
 void print_prompt() {
-    safe_write(STDOUT_FILENO, PROMPT, sizeof(PROMPT));
+    if (script == nullptr) {
+        safe_write(STDOUT_FILENO, PROMPT, sizeof(PROMPT));
+    }
 }
 
 
@@ -147,10 +283,123 @@ void remove_from_epoll(int fd) {
 }
 
 
+// Children exit notifications come as SIGCHLD through sig_fd.
+void reap_children() {
+    signalfd_siginfo info;
+    while (read(sig_fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        auto it = std::find(launched_pids.begin(), launched_pids.end(), pid);
+        if (it != launched_pids.end()) {
+            launched_pids.erase(it);
+            continue;
+        }
+
+        for (auto job_it = jobs.begin(); job_it != jobs.end(); ++job_it) {
+            auto pid_it = std::find(job_it->pids.begin(), job_it->pids.end(), pid);
+            if (pid_it == job_it->pids.end()) {
+                continue;
+            }
+            job_it->pids.erase(pid_it);
+            if (job_it->pids.empty()) {
+                if (script == nullptr) {
+                    printf("[%d] Done\t%s\n", job_it->id, job_it->line.c_str());
+                    fflush(stdout);
+                }
+                jobs.erase(job_it);
+            }
+            break;
+        }
+    }
+}
+
+
+// Moves the just launched processes to a new background job.
+void start_job() {
+    job new_job;
+    new_job.id = jobs.empty() ? 1 : jobs.back().id + 1;
+    new_job.pids.assign(launched_pids.begin(), launched_pids.end());
+    launched_pids.clear();
+    for (command const& cmd : parser.commands()) {
+        for (char* const* arg = cmd.argv; *arg != nullptr; ++arg) {
+            new_job.line += new_job.line.empty() ? "" : " ";
+            new_job.line += *arg;
+        }
+    }
+    if (script == nullptr) {
+        printf("[%d] %d\n", new_job.id, new_job.pids.back());
+        fflush(stdout);
+    }
+    jobs.push_back(new_job);
+}
+
+
+bool open_script(const char* path) {
+    int fd = path == nullptr ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        return false;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: not a regular file\n", path != nullptr ? path : "stdin");
+        return false;
+    }
+
+    script_size = st.st_size;
+    script = "";
+    if (script_size != 0) {
+        void* addr = mmap(nullptr, script_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            perror("mmap()");
+            return false;
+        }
+        madvise(addr, script_size, MADV_SEQUENTIAL);
+        script = static_cast<const char*>(addr);
+    }
+
+    if (path == nullptr) {
+        // The script is stdin itself, the commands find it read to the end
+        lseek(fd, 0, SEEK_END);
+    } else {
+        close(fd);
+    }
+    return true;
+}
+
+
+void finish_command() {
+    print_prompt();
+}
+
+
 int main(int argc, char const *argv[]) {
     epoll_event events[MAX_EVENTS];
     struct sigaction sa;
 
+    int opt;
+    while ((opt = getopt(argc, const_cast<char* const*>(argv), "j:")) != -1) {
+        if (opt == 'j' && atoi(optarg) > 0) {
+            max_jobs = atoi(optarg);
+        } else {
+            printf("%s", USAGE);
+            return 0;
+        }
+    }
+
+    struct stat st;
+    if (argc - optind > 1) {
+        printf("%s", USAGE);
+        return 0;
+    } else if (argc - optind == 1 || (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))) {
+        if (!open_script(argc - optind == 1 ? argv[optind] : nullptr)) {
+            return 1;
+        }
+    }
+
     bzero(&sa, sizeof(sa));
     sa.sa_sigaction = sig_handler;
     sa.sa_flags = SA_SIGINFO;
@@ -160,19 +409,43 @@ int main(int argc, char const *argv[]) {
         return errno;
     }
 
-    if (pipe2(global_pipe, O_CLOEXEC) == -1) {
+    // SIGCHLD is only taken from sig_fd, children get an empty mask
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+    sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sig_fd == -1) {
+        perror("signalfd()");
+        return errno;
+    }
+
+    if (pipe2(global_pipe, O_CLOEXEC) == -1 || pipe2(peek_pipe, O_CLOEXEC) == -1) {
         perror("pipe()");
         return errno;
     }
+    fcntl(global_pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+    fcntl(peek_pipe[1], F_SETPIPE_SZ, static_cast<int>(MAX_LINE));
+    null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
     print_prompt();
 
     is_terminating = false;
     epoll_fd = epoll_create(1);
-    add_to_epoll(STDIN_FILENO, EPOLLIN);
+    if (script == nullptr) {
+        add_to_epoll(STDIN_FILENO, EPOLLIN);
+    }
+    add_to_epoll(sig_fd, EPOLLIN);
 
-    while(!is_terminating || launched_pids.size() != 0) {
-        int num_ev = epoll_wait(epoll_fd, events, MAX_EVENTS, 100);
+    while (true) {
+        while (launched_pids.size() == 0 && !is_terminating && load_command()) {
+        }
+        // Background jobs are waited for at the end of the input
+        if (is_terminating && !is_parsed_ahead && launched_pids.size() == 0 && jobs.empty()) {
+            break;
+        }
+
+        int num_ev = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
         if (num_ev == -1) {
             if (errno != EINTR) {
                 perror("epoll_wait1");
@@ -182,53 +455,26 @@ int main(int argc, char const *argv[]) {
             }
         }
 
-        if (launched_pids.size() != 0) {
-            auto it = launched_pids.begin();
-            while (it != launched_pids.end()) {
-                int status;
-                pid_t return_pid = waitpid(*it, &status, WNOHANG);
-                if (return_pid == *it) {
-                    it = launched_pids.erase(it);
-                } else {
-                    ++it;
-                }
-            }
-
-            if (is_stdin_eof) {
-                struct pollfd fd;
-                fd.fd = global_pipe[0];
-                fd.events = POLLIN;
-                if (poll(&fd, 1, 0) == 0) {
-                    close(global_pipe[1]);
-                }
-            }
-
-            if (launched_pids.size() == 0) {
-                for(auto it = parsed_data.begin(); it != parsed_data.end(); ++it) {
-                    for(auto inner_it = it->begin(); inner_it != it->end(); ++inner_it) {
-                        delete[] *inner_it;
-                    }
-                }
-
-                print_prompt();
-                input_buffer.clear();
-
-                if (is_stdin_eof) {
-                    add_to_epoll(STDIN_FILENO, EPOLLIN);
-                }
-            }
-        }
-
+        bool is_running = launched_pids.size() != 0;
         for (int i = 0; i < num_ev; ++i) {
             // printf("event -> %d, %d\n", events[i].data.fd, events[i].events);
-            if (launched_pids.size() == 0) {
-                load_command();
-            } else if (events[i].data.fd == STDIN_FILENO && !is_stdin_eof) {
-                put_stdin_to_pipe();
+            if (events[i].data.fd == sig_fd) {
+                reap_children();
+            } else if (events[i].data.fd == STDIN_FILENO) {
+                forward_stdin();
+            } else if (events[i].data.fd == global_pipe[1]) {
+                // There is room in the pipe again
+                remove_from_epoll(global_pipe[1]);
+                add_to_epoll(STDIN_FILENO, EPOLLIN);
             }
         }
+
+        if (is_running && launched_pids.size() == 0) {
+            finish_command();
+        }
     }
 
+    close(sig_fd);
     close(epoll_fd);
     return 0;
 }
@@ -270,119 +516,187 @@ int safe_read(int fd, char* buf, size_t size, bool is_non_block=false) {
 }
 
 
-void put_stdin_to_pipe() {
-    char buf[BUFFER_SIZE];
-    int cnt = safe_read(STDIN_FILENO, buf, BUFFER_SIZE);
+// Moves what is available on stdin to the end of global_pipe, spliced when
+// stdin is a pipe too.
+void forward_stdin() {
+    ssize_t cnt = splice(STDIN_FILENO, nullptr, global_pipe[1], nullptr, PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (cnt == -1 && errno == EINVAL) {
+        char buf[BUFFER_SIZE];
+        cnt = safe_read(STDIN_FILENO, buf, BUFFER_SIZE);
+        if (cnt > 0) {
+            safe_write(global_pipe[1], buf, cnt);
+        }
+    }
+
     if (cnt == 0) {
         // printf("read -> 0\n");
         is_stdin_eof = true;
         remove_from_epoll(STDIN_FILENO);
-        return;
+        // The rest of the input is already in the pipe, readers get EOF after it
+        close(global_pipe[1]);
+    } else if (cnt == -1 && errno == EAGAIN) {
+        // The pipe is full, stdin waits until the children read some
+        remove_from_epoll(STDIN_FILENO);
+        add_to_epoll(global_pipe[1], EPOLLOUT);
+    } else if (cnt == -1 && errno != EINTR) {
+        perror("splice()");
+        exit(errno);
+    }
+}
+
+
+// Copies up to size bytes from the head of global_pipe, consumes nothing.
+size_t peek_input(char* buf, size_t size) {
+    ssize_t cnt = tee(global_pipe[0], peek_pipe[1], size, SPLICE_F_NONBLOCK);
+    if (cnt == -1) {
+        if (errno != EAGAIN) {
+            perror("tee()");
+            exit(errno);
+        }
+        return 0;
+    }
+    for (ssize_t pos = 0; pos < cnt; ) {
+        pos += safe_read(peek_pipe[0], &buf[pos], cnt - pos);
     }
+    return cnt;
+}
 
-    safe_write(global_pipe[1], buf, cnt);
+
+bool read_script_line() {
+    if (script_pos == script_size) {
+        is_terminating = true;
+        return false;
+    }
+    const char* line = script + script_pos;
+    const char* newline = static_cast<const char*>(memchr(line, NEWLINE, script_size - script_pos));
+    size_t len = newline != nullptr ? newline - line + 1 : script_size - script_pos;
+    input_buffer.assign(line, len);
+    if (newline == nullptr) {
+        input_buffer += NEWLINE;
+    }
+    script_pos += len;
+    return true;
 }
 
-void load_command() {
-    parsed_data.clear();
-    char buf[BUFFER_SIZE];
 
-    fcntl(global_pipe[0], F_SETFL, O_NONBLOCK);
+// Takes the next command line of the input to input_buffer. Returns false
+// when there is no complete line yet or the input is over.
+bool read_line() {
+    if (script != nullptr) {
+        return read_script_line();
+    }
 
-    int pipe_cnt;
-    while (true) {
-        int cnt = safe_read(global_pipe[0], buf, BUFFER_SIZE, true);
-        if (cnt != -1) {
-            pipe_cnt = cnt;
+    char buf[MAX_LINE];
+    size_t size = 0, window = BUFFER_SIZE;
+    char* newline = nullptr;
+    while (newline == nullptr) {
+        size = peek_input(buf, window);
+        newline = static_cast<char*>(memchr(buf, NEWLINE, size));
+        if (newline == nullptr && size == MAX_LINE) {
+            // No line end in sight, none of it is input of the command
+            for (size_t pos = 0; pos < size; ) {
+                pos += safe_read(global_pipe[0], &buf[pos], size - pos);
+            }
+            long_line.append(buf, size);
+            window = MAX_LINE;
+            continue;
         }
-        if (cnt > 0) {
-            input_buffer += {buf, static_cast<size_t>(cnt)};
-        } else if (errno == EAGAIN || cnt == 0) {
+        if (size < window || window == MAX_LINE) {
             break;
-        } else {
-            perror("read from pipe");
-            exit(errno);
         }
+        window = std::min(window * 2, MAX_LINE);
     }
-    fcntl(global_pipe[0], F_SETFL, 0);
-
-    // printf("cnt: %d\n", pipe_cnt);
 
-    int cnt = safe_read(STDIN_FILENO, buf, BUFFER_SIZE);
-    if (cnt == 0) {
-        if (input_buffer.size() == 0) {
-            // printf("terminating...\n");
-            is_terminating = true;
-            remove_from_epoll(global_pipe[0]);
-            close(global_pipe[0]);
-            close(global_pipe[1]);
-            return;
-        }
+    size_t len;
+    if (newline != nullptr) {
+        len = newline - buf + 1;
+    } else if (is_stdin_eof) {
+        // The last line may have no newline
+        len = size;
     } else {
-        input_buffer += {buf, static_cast<size_t>(cnt)};
+        return false;
     }
 
-    size_t pos = input_buffer.find(NEWLINE);
-    if (pos == std::string::npos) {
-        if (cnt == 0 && pipe_cnt < static_cast<int>(BUFFER_SIZE)) {
-            input_buffer += NEWLINE;
-            pos = input_buffer.size() - 1;
-        } else {
-            return;
-        }
+    if (len == 0 && long_line.empty()) {
+        // printf("terminating...\n");
+        is_terminating = true;
+        close(global_pipe[0]);
+        return false;
     }
 
-    if (pos == 0) {
-        input_buffer.clear();
-        print_prompt();
-        return;
+    // Only the command itself leaves the pipe
+    for (size_t pos = 0; pos < len; ) {
+        pos += safe_read(global_pipe[0], &buf[pos], len - pos);
     }
-
-    std::string extra_data {input_buffer, pos + 1};
-    input_buffer.resize(pos + 1);
-    if (extra_data.size() > 0) {
-        safe_write(global_pipe[1], extra_data.c_str(), extra_data.size());
+    input_buffer.swap(long_line);
+    long_line.clear();
+    input_buffer.append(buf, len);
+    if (newline == nullptr) {
+        input_buffer += NEWLINE;
     }
+    return true;
+}
 
-    // printf("input_buffer: '%s'\n", input_buffer.c_str());
-    // printf("extra_data: '%s'\n", extra_data.c_str());
+
+// Takes the next command line from the input and launches it. Returns false
+// when there is no complete line yet.
+bool load_command() {
+    if (!is_parsed_ahead) {
+        if (!read_line()) {
+            return false;
+        }
+        // printf("input_buffer: '%s'\n", input_buffer.c_str());
+        is_parsed_ok = parser.parse(&input_buffer[0]);
+    }
+    if (is_parsed_ok && parser.is_background && jobs.size() >= max_jobs) {
+        // Keep it until some job is done
+        is_parsed_ahead = true;
+        return false;
+    }
+    is_parsed_ahead = false;
 
     // Ready to process commands
-    if(!parse_buffer(input_buffer, parsed_data)) {
-        return;
+    if (!is_parsed_ok) {
+        fprintf(stderr, "simplesh: %s\n", parser.error);
+        finish_command();
+        return true;
     }
 
-    int *fildes;
+    std::vector<command> const& commands = parser.commands();
+    if (commands.size() == 1 && !parser.is_background && run_builtin(commands[0])) {
+        finish_command();
+        return true;
+    }
 
-    if (parsed_data.size() == 1) {
-        create_process(parsed_data[0][0], parsed_data[0].data(), global_pipe[0]);
-    } else {
-        fildes = new int[(parsed_data.size() - 1) * 2];
-        for(size_t i = 0; i < parsed_data.size() - 1; ++i) {
-            if (pipe2(&fildes[i * 2], O_CLOEXEC) == -1) {
-                perror("pipe2()");
-                exit(errno);
-            }
+    int first_in_fd = parser.is_background ? null_fd : script != nullptr ? STDIN_FILENO : global_pipe[0];
+    int in_fd = first_in_fd;
+    for (size_t i = 0; i < commands.size(); ++i) {
+        int fildes[2] = {-1, STDOUT_FILENO};
+        if (i + 1 != commands.size() && pipe2(fildes, O_CLOEXEC) == -1) {
+            perror("pipe2()");
+            exit(errno);
         }
-
-        create_process(parsed_data[0][0], parsed_data[0].data(), global_pipe[0], fildes[1], fildes[0]);
-        for(size_t i = 1; i < parsed_data.size(); ++i) {
-            if(i + 1 == parsed_data.size()) {
-                create_process(parsed_data[i][0], parsed_data[i].data(), fildes[(i - 1) * 2], STDOUT_FILENO, fildes[i * 2 - 1]);
-            } else {
-                create_process(parsed_data[i][0], parsed_data[i].data(), fildes[(i - 1) * 2], fildes[(i * 2 + 1)]);
-            }
+        launch_command(commands[i], in_fd, fildes[1]);
+        if (in_fd != first_in_fd) {
+            close(in_fd);
+        }
+        if (fildes[1] != STDOUT_FILENO) {
+            close(fildes[1]);
         }
+        in_fd = fildes[0];
     }
 
-    for(size_t i = 0; i < (parsed_data.size() - 1) * 2; ++i) {
-        close(fildes[i]);
-        if (i + 1 == (parsed_data.size() - 1) * 2) {
-            delete[] fildes;
-        }
+    if (parser.is_background && launched_pids.size() != 0) {
+        start_job();
     }
 
-    if (is_stdin_eof) {
-        remove_from_epoll(STDIN_FILENO);
+    // Nothing could be started (or it runs in background), there is nobody to wait for
+    if (launched_pids.size() == 0) {
+        finish_command();
+    } else if (script != nullptr && read_line()) {
+        // The argvs are not needed once the processes are started
+        is_parsed_ok = parser.parse(&input_buffer[0]);
+        is_parsed_ahead = true;
     }
+    return true;
 }
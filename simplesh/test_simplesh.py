@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+# Checks of ./simplesh (make it first):
+#     python3 test_simplesh.py [simplesh binary]
+import os, subprocess, sys, time
+
+
+def run(binary, chunks, delay=0.0):
+    # Feeds the input in pieces, so that a line may arrive in several reads
+    shell = subprocess.Popen([binary], stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    for chunk in chunks:
+        shell.stdin.write(chunk)
+        shell.stdin.flush()
+        time.sleep(delay)
+    shell.stdin.close()
+    out = shell.stdout.read()
+    shell.wait()
+    # The prompt goes out with its terminating NUL
+    return out.replace(b'$ \0', b'')
+
+
+def check(name, ok, details=''):
+    print('%s: %s %s' % ('ok' if ok else 'FAILED', name, details))
+    return ok
+
+
+# Lines longer than the 64 kB peek window run whole, never in pieces.
+def test_long_lines(binary):
+    results = []
+    for size in (70000, 300000):
+        word = b'a' * size
+        out = run(binary, [b'echo ' + word + b'\necho next\n'])
+        results.append(check('%d byte line' % size, out == word + b'\nnext\n', '%d bytes out' % len(out)))
+    word = b'b' * 100000
+    out = run(binary, [b'echo ' + word[:70000], word[70000:] + b'\n'], delay=0.5)
+    results.append(check('line in two writes', out == word + b'\n', '%d bytes out' % len(out)))
+    out = run(binary, [b'echo ' + word])
+    results.append(check('last line without newline', out == word + b'\n', '%d bytes out' % len(out)))
+    out = run(binary, [b'echo ' + word + b'\ncat\n', b'input of cat\n'])
+    results.append(check('input after a long line', out == word + b'\ninput of cat\n', '%d bytes out' % len(out)))
+    return all(results)
+
+
+def main():
+    binary = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(os.path.abspath(__file__)), 'simplesh')
+    sys.exit(0 if test_long_lines(binary) else 1)
+
+
+if __name__ == '__main__':
+    main()